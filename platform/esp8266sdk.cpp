@@ -11,6 +11,7 @@ extern "C" {
   #include "gpio.h"
   #include "os_type.h"
   #include "user_interface.h"
+  #include "espconn.h"
 }
 
 #include <ESP8266WiFi.h>
@@ -84,33 +85,113 @@ bst_connect_state bst_get_connection_state() {
 }
 
 
-void bst_connect_to_wifi(const char* ssid, const char* passphrase) {
+// Access point and ip configuration of the current connection, for a fast reconnect.
+static bst_connect_hint connect_hint;
+// The ip configuration of a hint was applied, there is no EVENT_STAMODE_GOT_IP without dhcp.
+static bool static_ip_applied = false;
+
+// Report connection changes to the state machine as they happen,
+// instead of polling bst_get_connection_state().
+void prv_wifi_event(System_Event_t* event) {
+  switch (event->event) {
+      case EVENT_STAMODE_CONNECTED:
+        memcpy(connect_hint.bssid, event->event_info.connected.bssid, sizeof(connect_hint.bssid));
+        connect_hint.channel = event->event_info.connected.channel;
+        if (static_ip_applied) {
+          bst_connection_event(BST_STATE_CONNECTED);
+          bst_set_connect_hint(&connect_hint);
+        } else {
+          bst_connection_event(BST_STATE_CONNECTING);
+        }
+        break;
+      case EVENT_STAMODE_GOT_IP: {
+        uint32_t dns = WiFi.dnsIP(0);
+        memcpy(connect_hint.ip, &event->event_info.got_ip.ip.addr, 4);
+        memcpy(connect_hint.netmask, &event->event_info.got_ip.mask.addr, 4);
+        memcpy(connect_hint.gateway, &event->event_info.got_ip.gw.addr, 4);
+        memcpy(connect_hint.dns, &dns, 4);
+        bst_connection_event(BST_STATE_CONNECTED);
+        bst_set_connect_hint(&connect_hint);
+        break;
+      }
+      case EVENT_STAMODE_DISCONNECTED:
+        switch (event->event_info.disconnected.reason) {
+            case REASON_NO_AP_FOUND:
+              bst_connection_event(BST_STATE_FAILED_SSID_NOT_FOUND);
+              break;
+            case REASON_AUTH_FAIL:
+            case REASON_4WAY_HANDSHAKE_TIMEOUT:
+            case REASON_HANDSHAKE_TIMEOUT:
+              bst_connection_event(BST_STATE_FAILED_CREDENTIALS_WRONG);
+              break;
+            default:
+              bst_connection_event(BST_STATE_NO_CONNECTION);
+              break;
+        }
+        break;
+      default:
+        break;
+  };
+}
+
+// Connect with a full scan and dhcp, or directly to the access point and with the
+// ip configuration of the hint.
+static void prv_connect(const char* ssid, const char* passphrase, const bst_connect_hint* hint) {
   if (bst_get_state() == BST_MODE_CONNECTING_TO_DEST) {
     udpIPv4.stop();
   }
 
   static int static_counter = 0;
-  BST_DBG("connect %s %s (%d)\n", ssid, passphrase, static_counter);
+  BST_DBG("connect %s %s (%d) %s\n", ssid, passphrase, static_counter, hint ? "hinted" : "");
 
   struct station_config conf;
   strcpy(reinterpret_cast<char*>(conf.ssid), ssid);
   strcpy(reinterpret_cast<char*>(conf.password), passphrase);
-  conf.bssid_set = 0;
+  conf.bssid_set = hint ? 1 : 0;
+  if (hint)
+    memcpy(conf.bssid, hint->bssid, sizeof(hint->bssid));
   ETS_UART_INTR_DISABLE();
   wifi_set_opmode_current(WIFI_OFF);
   ETS_UART_INTR_ENABLE();
   delay(100);
 
+  // A failure of the last attempt is outdated now
+  bst_connection_event(BST_STATE_CONNECTING);
+
   ETS_UART_INTR_DISABLE();
   wifi_set_opmode_current(WIFI_STA);
+  static_ip_applied = hint != NULL;
+  if (hint) {
+    // Reported again with the bssid and channel of the connection
+    memcpy(&connect_hint, hint, sizeof(connect_hint));
+    struct ip_info info;
+    ip_addr_t dns;
+    memcpy(&info.ip.addr, hint->ip, 4);
+    memcpy(&info.netmask.addr, hint->netmask, 4);
+    memcpy(&info.gw.addr, hint->gateway, 4);
+    memcpy(&dns.addr, hint->dns, 4);
+    wifi_set_channel(hint->channel);
+    wifi_station_dhcpc_stop();
+    wifi_set_ip_info(STATION_IF, &info);
+    espconn_dns_setserver(0, &dns);
+  }
   wifi_station_set_config_current(&conf);
   wifi_station_connect();
   ETS_UART_INTR_ENABLE();
-  wifi_station_dhcpc_start();
+  if (!hint)
+    wifi_station_dhcpc_start();
 
   Serial.println(wifi_station_get_connect_status());
 }
 
+void bst_connect_to_wifi(const char* ssid, const char* passphrase) {
+  prv_connect(ssid, passphrase, NULL);
+}
+
+void bst_connect_to_wifi_hinted(const char* ssid, const char* passphrase, const bst_connect_hint* hint) {
+  prv_connect(ssid, passphrase, hint);
+}
+
 void bst_loop_esp8266() {
     int cb = udpIPv4.parsePacket();
     if (cb) {
@@ -189,6 +270,28 @@ void bst_request_wifi_network_list() {
     wifi_station_scan(&config, prv_scanDone);
 }
 
+void prv_discoveryDone(void* result, STATUS status) {
+    bss_info* it = status == OK ? reinterpret_cast<bss_info*>(result) : NULL;
+    if (it) {
+        bst_bootstrap_network_found(it->channel);
+    } else {
+        // The next probe of the library covers all channels
+        bst_bootstrap_network_not_found();
+    }
+}
+
+// A directed probe for the bootstrap ssid, on the hinted channel first.
+// This is much shorter than an association attempt.
+void bst_discover_bootstrap_network(const char* ssid, uint8_t channel_hint) {
+  struct scan_config config;
+    config.ssid = (uint8*)ssid;
+    config.bssid = 0;
+    config.channel = channel_hint;
+    config.show_hidden = true;
+    wifi_set_opmode_current(WIFI_STA);
+    wifi_station_scan(&config, prv_discoveryDone);
+}
+
 void bst_setup_esp8266(bst_connect_options& o)
 {
       if (!SPIFFS.begin())
@@ -213,6 +316,11 @@ void bst_setup_esp8266(bst_connect_options& o)
         configFile.close();
       }
 
+      // prv_wifi_event() reports all connection changes and the connect hint. The
+      // connection_events option is left to the caller: Polling is the default, because
+      // only bst_get_connection_state() detects a silently lost connection.
+      wifi_set_event_handler_cb(prv_wifi_event);
+
       bst_setup(o, bst_data, bst_data_len, bst_crypto, bst_crypto_len);
 }
 
@@ -1,6 +1,8 @@
 #include "bootstrapWifi.h"
 #include "prv_bootstrapWifi.h"
 #include "spritz.h"
+#include "crc16.h"
+#include <stddef.h>
 #include <string.h>
 
 #ifndef BST_NO_ERROR_MESSAGES
@@ -19,33 +21,230 @@
 #define STATIC_INLINE static inline
 #endif
 
-instance_t prv_instance;
+static void prv_enter_wait_for_bootstrap_mode(bst_ctx_t* ctx, prv_bst_error_state last_error_code, const char* last_error_message);
+static void prv_enter_bootstrapped_mode(bst_ctx_t* ctx);
+static void prv_process_packet(bst_ctx_t* ctx, char* data, size_t len);
+static void prv_send_wifi_list(bst_ctx_t* ctx, bst_wifi_list_entry_t* list);
+static bool prv_is_app_session_valid(bst_ctx_t* ctx);
+#ifdef BST_WIFI_SCAN_CACHE
+static inline bool prv_scan_cache_valid(bst_ctx_t* ctx);
+static bool prv_scan_cache_refresh_time(bst_ctx_t* ctx, time_t* t);
+#endif
 
-static void prv_enter_wait_for_bootstrap_mode(prv_bst_error_state last_error_code, const char* last_error_message);
-static void prv_enter_bootstrapped_mode();
+#ifdef BST_TRACE
+/// Append a record to the trace ring, overwrite the oldest one if it is full.
+static inline void prv_trace(bst_ctx_t* ctx, bst_trace_event event, uint8_t arg)
+{
+    bst_trace_record* r = &ctx->trace.records[ctx->trace.head++ & (BST_TRACE_SLOTS-1)];
+    r->time_ms = (uint32_t)ctx->callbacks->get_system_time_ms(ctx->user);
+    r->event = (uint8_t)event;
+    r->arg = arg;
+    if ((uint16_t)(ctx->trace.head - ctx->trace.tail) > BST_TRACE_SLOTS)
+        ++ctx->trace.tail;
+}
+#else
+#define prv_trace(ctx, event, arg)
+#endif
 
-#define CRC16 0x1021 // ("CRC-16/CCITT-FALSE")
-//#define CRC16 0x8005 // ("CRC-16")
+/// Count a rejected packet in bst_input_stats and trace the index of the counter.
+#define prv_count_rejected(ctx, counter) do { \
+        ++(ctx)->input_stats.counter; \
+        prv_trace(ctx, BST_TRACE_PACKET_REJECTED, offsetof(bst_input_stats, counter)/sizeof(uint32_t)); \
+    } while (0)
 
-/// CRC-16/CCITT-FALSE
-/// width=16 poly=0x1021 init=0xffff refin=false refout=false xorout=0x0000 check=0x29b1 name="CRC-16/CCITT-FALSE"
-bst_crc_value bst_crc16(const unsigned char *pData, uint16_t size)
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+/// Wipe the precomputed keystream and its suspended state, like the nonces
+/// at the end of an app session.
+static void prv_keystream_wipe(bst_ctx_t* ctx)
+{
+    if (!ctx->keystream.started)
+        return;
+    spritz_wipe(&ctx->keystream.state);
+    memset(ctx->keystream.data, 0, ctx->keystream.len);
+    memset(ctx->keystream.nonce, 0, BST_NONCE_SIZE);
+    ctx->keystream.len = 0;
+    ctx->keystream.started = false;
+}
+#else
+#define prv_keystream_wipe(ctx) ((void)(ctx))
+#endif
+
+static inline void prv_set_state(bst_ctx_t* ctx, bst_state state)
 {
-    uint16_t wCrc = 0xffff;
+    // The keystream is only precomputed while waiting for data
+    if (state != BST_MODE_WAITING_FOR_DATA)
+        prv_keystream_wipe(ctx);
+    ctx->state.state = state;
+    prv_trace(ctx, BST_TRACE_STATE, (uint8_t)state);
+}
 
-    while(size) {
-        wCrc ^= *pData++ << 8;
-        for (uint8_t i=0; i < 8; i++)
-            wCrc = (wCrc & 0x8000) ? ((wCrc << 1) ^ CRC16) : (wCrc << 1);
-        --size;
-    }
+static inline bool prv_crc16_equals(uint16_t wCrc, const bst_crc_value* v)
+{
+    return v->crc[0] == ((wCrc>>8) & 0xff) && v->crc[1] == (wCrc & 0xff);
+}
+
+void bst_crc16_init(bst_crc16_ctx* ctx)
+{
+    ctx->crc = BST_CRC16_INIT;
+}
+
+void bst_crc16_update(bst_crc16_ctx* ctx, const void *pData, size_t size)
+{
+    ctx->crc = crc16_ccitt_update(ctx->crc, (const unsigned char*)pData, size);
+}
 
+bst_crc_value bst_crc16_final(const bst_crc16_ctx* ctx)
+{
     bst_crc_value v;
-    v.crc[1] = wCrc & 0xff;
-    v.crc[0] = (wCrc>>8) & 0xff;
+    v.crc[1] = ctx->crc & 0xff;
+    v.crc[0] = (ctx->crc>>8) & 0xff;
     return v;
 }
 
+/// CRC-16/CCITT-FALSE, see crc16.h
+bst_crc_value bst_crc16(const unsigned char *pData, uint16_t size)
+{
+    bst_crc16_ctx ctx;
+    bst_crc16_init(&ctx);
+    bst_crc16_update(&ctx, pData, size);
+    return bst_crc16_final(&ctx);
+}
+
+/**
+ * @brief Decrypt data in place and compute the crc16 of the plaintext in the same pass.
+ * The keystream is generated in small blocks, every plaintext byte is fed into the
+ * crc as soon as it is decrypted. Data is therefore only read and written once.
+ * @return The crc16 of the plaintext.
+ */
+static uint16_t prv_decrypt_and_crc16(bst_ctx_t* ctx, unsigned char* data, size_t len, const char* nonce)
+{
+    uint16_t wCrc = BST_CRC16_INIT;
+    unsigned char keystream[SPRITZ_KEYSTREAM_BLOCK];
+    spritz_state state;
+
+    spritz_keyed_start(&state, (const unsigned char*)nonce, BST_NONCE_SIZE, &ctx->crypto_ctx);
+
+    while (len) {
+        const size_t block_len = len < SPRITZ_KEYSTREAM_BLOCK ? len : SPRITZ_KEYSTREAM_BLOCK;
+        spritz_squeeze(&state, keystream, block_len);
+        for (size_t i=0; i < block_len; ++i) {
+            const unsigned char plain = data[i] - keystream[i];
+            data[i] = plain;
+            wCrc = crc16_ccitt_byte(wCrc, plain);
+        }
+        data += block_len;
+        len -= block_len;
+    }
+
+    spritz_wipe(&state);
+    return wCrc;
+}
+
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+static inline bool prv_keystream_matches(bst_ctx_t* ctx, const char* nonce)
+{
+    return ctx->keystream.started &&
+            memcmp(ctx->keystream.nonce, nonce, BST_NONCE_SIZE) == 0;
+}
+
+/**
+ * Generate the next BST_PRECOMPUTE_KEYSTREAM_CHUNK bytes of the keystream
+ * for outgoing packets of the current app session. Restarts if the app nonce changed.
+ */
+static void prv_precompute_keystream(bst_ctx_t* ctx)
+{
+    if (!ctx->state.time_nonce_valid || !prv_is_app_session_valid(ctx))
+        return;
+
+    if (!prv_keystream_matches(ctx, ctx->state.prv_app_nonce)) {
+        spritz_keyed_start(&ctx->keystream.state,
+                           (const unsigned char*)ctx->state.prv_app_nonce, BST_NONCE_SIZE,
+                           &ctx->crypto_ctx);
+        memcpy(ctx->keystream.nonce, ctx->state.prv_app_nonce, BST_NONCE_SIZE);
+        ctx->keystream.len = 0;
+        ctx->keystream.started = true;
+    }
+
+    size_t remaining = sizeof(ctx->keystream.data) - ctx->keystream.len;
+    if (remaining > BST_PRECOMPUTE_KEYSTREAM_CHUNK)
+        remaining = BST_PRECOMPUTE_KEYSTREAM_CHUNK;
+    spritz_squeeze(&ctx->keystream.state,
+                   ctx->keystream.data+ctx->keystream.len, remaining);
+    ctx->keystream.len += remaining;
+}
+#endif
+
+static inline void prv_send_stream_init(prv_send_stream* stream)
+{
+    stream->offset = 0;
+    stream->started = false;
+}
+
+static inline void prv_send_stream_wipe(prv_send_stream* stream)
+{
+    if (stream->started)
+        spritz_wipe(&stream->state);
+}
+
+/**
+ * @brief Compute the crc16 of the plaintext and encrypt data in place in the same pass.
+ * The crc field of our packets is located before the encrypted area, so there is no
+ * need to know the crc before encrypting.
+ *
+ * If BST_PRECOMPUTE_KEYSTREAM is set, the already precomputed keystream is used first.
+ * @param stream The keystream, continues where the last call stopped.
+ * @return The crc16 of the plaintext.
+ */
+static uint16_t prv_crc16_and_encrypt(bst_ctx_t* ctx, prv_send_stream* stream, unsigned char* data, size_t len, const char* nonce)
+{
+    uint16_t wCrc = BST_CRC16_INIT;
+    unsigned char keystream[SPRITZ_KEYSTREAM_BLOCK];
+
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+    const bool precomputed = prv_keystream_matches(ctx, nonce);
+    if (precomputed && stream->offset < ctx->keystream.len) {
+        const unsigned char* ks = ctx->keystream.data + stream->offset;
+        size_t precomputed_len = ctx->keystream.len - stream->offset;
+        if (precomputed_len > len)
+            precomputed_len = len;
+        for (size_t i=0; i < precomputed_len; ++i) {
+            const unsigned char plain = data[i];
+            wCrc = crc16_ccitt_byte(wCrc, plain);
+            data[i] = plain + ks[i];
+        }
+        data += precomputed_len;
+        len -= precomputed_len;
+        stream->offset += precomputed_len;
+    }
+
+    if (len && !stream->started && precomputed) {
+        // Continue after the precomputed part, without modifying the cached state.
+        memcpy(&stream->state, &ctx->keystream.state, sizeof(spritz_state));
+        stream->started = true;
+    }
+#endif
+
+    if (len && !stream->started) {
+        spritz_keyed_start(&stream->state, (const unsigned char*)nonce, BST_NONCE_SIZE, &ctx->crypto_ctx);
+        stream->started = true;
+    }
+
+    stream->offset += len;
+    while (len) {
+        const size_t block_len = len < SPRITZ_KEYSTREAM_BLOCK ? len : SPRITZ_KEYSTREAM_BLOCK;
+        spritz_squeeze(&stream->state, keystream, block_len);
+        for (size_t i=0; i < block_len; ++i) {
+            const unsigned char plain = data[i];
+            wCrc = crc16_ccitt_byte(wCrc, plain);
+            data[i] = plain + keystream[i];
+        }
+        data += block_len;
+        len -= block_len;
+    }
+
+    return wCrc;
+}
+
 STATIC_INLINE bool prv_crc16_is_valid(bst_udp_receive_pkt_t* pkt, size_t pkt_len) {
     // Do not take the header, command and crc field into account for crc calculation.
     const size_t offset = sizeof(bst_udp_receive_pkt_t);
@@ -53,16 +252,25 @@ STATIC_INLINE bool prv_crc16_is_valid(bst_udp_receive_pkt_t* pkt, size_t pkt_len
     return memcmp(&(v.crc),&(pkt->crc),sizeof(bst_crc_value)) == 0;
 }
 
-static bool prv_is_app_session_valid() {
-    bool valid = prv_instance.state.time_nonce_valid >= bst_get_system_time_ms();
+static bool prv_is_app_session_valid(bst_ctx_t* ctx) {
+    bool valid = ctx->state.time_nonce_valid >= ctx->callbacks->get_system_time_ms(ctx->user);
     if (!valid) {
-        prv_instance.state.time_nonce_valid = 0;
-        memset(prv_instance.state.prv_app_nonce,0,BST_NONCE_SIZE);
-        memset(prv_instance.state.prv_device_nonce,0,BST_NONCE_SIZE);
+        ctx->state.time_nonce_valid = 0;
+        memset(ctx->state.prv_app_nonce,0,BST_NONCE_SIZE);
+        memset(ctx->state.prv_device_nonce,0,BST_NONCE_SIZE);
+        prv_keystream_wipe(ctx);
     }
     return valid;
 }
 
+/// Absorb ctx->crypto_secret into ctx->crypto_ctx. Has to be called
+/// whenever the secret changes. This saves the key setup for every single packet.
+static void prv_renew_crypto_ctx(bst_ctx_t* ctx) {
+    spritz_keyed_setup(&ctx->crypto_ctx,
+                       (unsigned char*)ctx->crypto_secret,ctx->crypto_secret_len);
+    prv_keystream_wipe(ctx);
+}
+
 /**
  * @brief Called if we receive a HELLO packet from a bootstrap app.
  * This either starts a new app session if no one is active at the time and uses the given app_nonce
@@ -73,118 +281,247 @@ static bool prv_is_app_session_valid() {
  * app has to wait for the session timeout (time_nonce_valid).
  * @param app_nonce
  */
-static inline bool prv_enter_and_keep_app_session(const char* app_nonce) {
-    time_t current_time = bst_get_system_time_ms();
+static inline bool prv_enter_and_keep_app_session(bst_ctx_t* ctx, const char* app_nonce) {
+    time_t current_time = ctx->callbacks->get_system_time_ms(ctx->user);
     bool valid;
 
     // Start a new session with a new device nonce.
-    if (!prv_instance.state.time_nonce_valid || prv_instance.state.time_nonce_valid <= current_time)
+    if (!ctx->state.time_nonce_valid || ctx->state.time_nonce_valid <= current_time)
     {
-        memcpy(prv_instance.state.prv_app_nonce, app_nonce, BST_NONCE_SIZE);
+        prv_keystream_wipe(ctx);
+        memcpy(ctx->state.prv_app_nonce, app_nonce, BST_NONCE_SIZE);
         valid = true;
     } else
-        valid = memcmp(prv_instance.state.prv_app_nonce, app_nonce, BST_NONCE_SIZE) == 0;
+        valid = memcmp(ctx->state.prv_app_nonce, app_nonce, BST_NONCE_SIZE) == 0;
 
     if (valid)
     {
         // Renew device nonce on every call to this method.
-        prv_instance.state.time_nonce_valid = prv_instance.options.timeout_nonce_ms + current_time;
-        uint64_t* p = (uint64_t*)prv_instance.state.prv_device_nonce;
+        ctx->state.time_nonce_valid = ctx->options.timeout_nonce_ms + current_time;
+        uint64_t* p = (uint64_t*)ctx->state.prv_device_nonce;
         for (unsigned i=0;i<BST_NONCE_SIZE/8;++i) {
-             p[i] = bst_get_random();
+             p[i] = ctx->callbacks->get_random(ctx->user);
         }
     }
 
     return valid;
 }
 
+/// Return the protocol version of the packet header or 0 if it is not a valid header.
+static inline uint8_t prv_header_version(const char* hdr_in)
+{
+    const char hdr[] = BST_NETWORK_HEADER;
+    if (memcmp(hdr_in, hdr, BST_NETWORK_HEADER_SIZE-1) != 0)
+        return 0;
+
+    const uint8_t version = (uint8_t)(hdr_in[BST_NETWORK_HEADER_SIZE-1] - '0');
+    return version >= 1 && version <= BST_PROTOCOL_VERSION ? version : 0;
+}
+
+static inline bool prv_check_header(const bst_udp_receive_pkt_t* pkt)
+{
+    return prv_header_version(pkt->hdr) != 0;
+}
+
+/// Write BST_NETWORK_HEADER with the protocol version of the app session.
+static inline void prv_write_header(bst_ctx_t* ctx, char* hdr_out)
+{
+    const char hdr[] = BST_NETWORK_HEADER;
+    memcpy(hdr_out, hdr, BST_NETWORK_HEADER_SIZE);
+    if (ctx->state.protocol_version > 1)
+        hdr_out[BST_NETWORK_HEADER_SIZE-1] = (char)('0' + ctx->state.protocol_version);
+}
+
+/**
+ * @brief Return true if the crc value is correct after decryption with the
+ * ctx->crypto_secret and the device nonce (ctx->state.prv_device_nonce).
+ * HELLO packets are not encrypted, only the crc is checked.
+ */
+static bool prv_check_crc_and_decrypt(bst_ctx_t* ctx, bst_udp_receive_pkt_t* pkt, size_t pkt_len)
+{
+    // HELLO packets are not encrypted, just check the crc16
+    if (pkt->command_code == CMD_HELLO)
+        return prv_crc16_is_valid(pkt, pkt_len);
+
+    // Decrypt and check the crc16 in one pass.
+    const size_t offset = sizeof(bst_udp_receive_pkt_t);
+    uint16_t wCrc = prv_decrypt_and_crc16(ctx, (unsigned char*)pkt+offset, pkt_len-offset,
+                                          ctx->state.prv_device_nonce);
+    return prv_crc16_equals(wCrc, &pkt->crc);
+}
+
 /**
  * @brief Return true if the header equals BST_NETWORK_HEADER and the crc value
- * is correct after decryption with the prv_instance.crypto_secret
- * and the device nonce (prv_instance.state.prv_device_nonce).
+ * is correct after decryption with the ctx->crypto_secret
+ * and the device nonce (ctx->state.prv_device_nonce).
  * @param pkt The packet to decrypt and check.
  * @param pkt_len The packet length.
  * @return
  */
-STATIC_INLINE bool prv_check_header_and_decrypt(bst_udp_receive_pkt_t* pkt, size_t pkt_len)
+STATIC_INLINE bool prv_check_header_and_decrypt(bst_ctx_t* ctx, bst_udp_receive_pkt_t* pkt, size_t pkt_len)
 {
-    const char hdr[] = BST_NETWORK_HEADER;
-    if (memcmp(pkt->hdr, hdr, BST_NETWORK_HEADER_SIZE) != 0) {
+    if (!prv_check_header(pkt)) {
       BST_DBG("Header wrong\n");
       return false;
     }
 
-    // decrypt. HELLO packets are not encrypted
-    if (pkt->command_code != CMD_HELLO)
-    {
-        const size_t offset = sizeof(bst_udp_receive_pkt_t);
+    return prv_check_crc_and_decrypt(ctx, pkt, pkt_len);
+}
 
-        unsigned char* out_in = (unsigned char*)pkt+offset;
-        spritz_decrypt(out_in,out_in,pkt_len-offset,
-                       (unsigned char*)prv_instance.state.prv_device_nonce,BST_NONCE_SIZE,
-                       (unsigned char*)prv_instance.crypto_secret,prv_instance.crypto_secret_len);
+/// The exact length of a packet with the given command or 0 for unknown commands.
+static size_t prv_expected_length(uint8_t command_code)
+{
+    switch (command_code) {
+        case CMD_HELLO: return sizeof(bst_udp_hello_receive_pkt_t);
+        case CMD_BIND: return sizeof(bst_udp_bind_receive_pkt_t);
+        case CMD_SET_DATA: return sizeof(bst_udp_bootstrap_receive_pkt_t);
+        default: return 0;
     }
+}
 
-    // Check crc16
-    return prv_crc16_is_valid(pkt, pkt_len);
+/**
+ * @brief Check everything that does not need the packet content: Would the
+ * packet change anything if its crc turns out to be valid? Updates the
+ * rejection counters.
+ */
+static bool prv_could_be_accepted(bst_ctx_t* ctx, const bst_udp_receive_pkt_t* pkt)
+{
+    switch (pkt->command_code) {
+        case CMD_HELLO: {
+            // To protect from DOS we do not accept rapidly changing app_nonces,
+            // see prv_enter_and_keep_app_session(). The nonce is not encrypted.
+            const bst_udp_hello_receive_pkt_t* pkt_hello = (const bst_udp_hello_receive_pkt_t*)pkt;
+            if (ctx->state.time_nonce_valid > ctx->callbacks->get_system_time_ms(ctx->user) &&
+                    memcmp(ctx->state.prv_app_nonce, pkt_hello->app_nonce, BST_NONCE_SIZE) != 0) {
+                BST_DBG("net: hello. no app session\n");
+                prv_count_rejected(ctx, rejected_session);
+                return false;
+            }
+            return true;
+        }
+        case CMD_BIND:
+            if (!prv_is_app_session_valid(ctx)) {
+                BST_DBG("net: no app session\n");
+                prv_count_rejected(ctx, rejected_session);
+                return false;
+            }
+            if (ctx->flags.request_bind) {
+                prv_count_rejected(ctx, rejected_pending);
+                return false;
+            }
+            return true;
+        case CMD_SET_DATA:
+            if (!prv_is_app_session_valid(ctx)) {
+                BST_DBG("net: no app session\n");
+                prv_count_rejected(ctx, rejected_session);
+                return false;
+            }
+            if (ctx->flags.request_set_wifi) {
+                prv_count_rejected(ctx, rejected_pending);
+                return false;
+            }
+            if (ctx->options.external_confirmation_mode != BST_CONFIRM_NOT_REQUIRED &&
+                    !ctx->flags.external_confirmation) {
+                BST_DBG("net: setdata confirmation missing\n");
+                prv_count_rejected(ctx, rejected_confirmation);
+                return false;
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Token bucket for packets that need a crc check or decryption.
+ * Up to BST_INPUT_RATE_BURST packets are checked at once, then one
+ * every BST_INPUT_RATE_REFILL_MS. Authenticated packets return their
+ * token with prv_return_input_token().
+ */
+static bool prv_take_input_token(bst_ctx_t* ctx)
+{
+    const time_t now = ctx->callbacks->get_system_time_ms(ctx->user);
+    const time_t refill = (now - ctx->input_rate.last_refill) / BST_INPUT_RATE_REFILL_MS;
+
+    if (refill > 0) {
+        ctx->input_rate.spent = refill >= ctx->input_rate.spent ?
+                    0 : ctx->input_rate.spent - refill;
+        ctx->input_rate.last_refill = now;
+    }
+
+    if (ctx->input_rate.spent >= BST_INPUT_RATE_BURST)
+        return false;
+
+    ++ctx->input_rate.spent;
+    return true;
+}
+
+static inline void prv_return_input_token(bst_ctx_t* ctx)
+{
+    if (ctx->input_rate.spent)
+        --ctx->input_rate.spent;
 }
 
 /**
- * @brief Compute a checksum for the content and encrypt it with the prv_instance.crypto_secret
- * and the app nonce (prv_instance.state.prv_app_nonce).
+ * @brief Compute a checksum for the content and encrypt it with the ctx->crypto_secret
+ * and the app nonce (ctx->state.prv_app_nonce).
  * We compute the checksum and encrypt the content only and skip the header and the command field.
  * @param pkt The packet to encrypt.
  * @param pkt_len The packet length.
  */
-STATIC_INLINE void prv_add_checksum_and_encrypt(bst_udp_send_pkt_t* pkt, size_t pkt_len)
+static void prv_add_checksum_and_encrypt_stream(bst_ctx_t* ctx, bst_udp_send_hdr_t* pkt, size_t pkt_len, prv_send_stream* stream)
 {
-    // bst_udp_receive_pkt_t consists only of the header, the command and the crc field.
-    // We therefor use its size for the offset. bst_udp_send_pkt_t uses the same structure.
-    const size_t offset = sizeof(bst_udp_receive_pkt_t);
-
-    pkt_len -= offset;
+    uint16_t wCrc = prv_crc16_and_encrypt(ctx, stream, (unsigned char*)pkt+BST_ENCRYPTED_OFFSET,
+                                           pkt_len-BST_ENCRYPTED_OFFSET, ctx->state.prv_app_nonce);
+    pkt->crc.crc[1] = wCrc & 0xff;
+    pkt->crc.crc[0] = (wCrc>>8) & 0xff;
+}
 
-    pkt->crc = bst_crc16((unsigned char*)pkt+offset, pkt_len);
+STATIC_INLINE void prv_add_checksum_and_encrypt(bst_ctx_t* ctx, bst_udp_send_hdr_t* pkt, size_t pkt_len)
+{
+    prv_send_stream_init(&ctx->send.stream);
+    prv_add_checksum_and_encrypt_stream(ctx, pkt, pkt_len, &ctx->send.stream);
+    prv_send_stream_wipe(&ctx->send.stream);
+}
 
-    // encrypt
-    unsigned char* out_in = (unsigned char*)pkt+offset;
-    spritz_encrypt(out_in,out_in, pkt_len,
-                   (unsigned char*)prv_instance.state.prv_app_nonce,BST_NONCE_SIZE,
-                   (unsigned char*)prv_instance.crypto_secret,prv_instance.crypto_secret_len);
+static inline uint8_t prv_confirmation_state(bst_ctx_t* ctx)
+{
+    if (ctx->options.external_confirmation_mode == BST_CONFIRM_NOT_REQUIRED)
+        return CONFIRM_NOT_REQUIRED;
+    return ctx->flags.external_confirmation ? CONFIRM_OK : CONFIRM_REQUIRED;
 }
 
 /**
- * @brief Add the BST_NETWORK_HEADER header and device nonce to the given packet.
+ * @brief Add the BST_NETWORK_HEADER header, device nonce, uid and confirmation state
+ * to the common start of a packet.
  * You have to call prv_add_checksum_and_encrypt() after adding the content to the packet.
  * @param pkt The packet.
  */
-STATIC_INLINE void prv_add_header(bst_udp_send_pkt_t* pkt)
+STATIC_INLINE void prv_add_header(bst_ctx_t* ctx, bst_udp_send_hdr_t* pkt)
 {
-    const char hdr[] = BST_NETWORK_HEADER;
-    memcpy((char*)pkt->hdr, hdr, sizeof(BST_NETWORK_HEADER)-1);
-    pkt->state_code = prv_instance.state.last_error;
-    memcpy(pkt->uid, prv_instance.options.unique_device_id, BST_UID_SIZE);
-    memcpy(pkt->device_nonce, prv_instance.state.prv_device_nonce, BST_NONCE_SIZE);
-    pkt->wifi_list_size_in_bytes = 0;
-    pkt->wifi_list_entries = 0;
+    prv_write_header(ctx, pkt->hdr);
+    pkt->state_code = ctx->state.last_error;
+    memcpy(pkt->uid, ctx->options.unique_device_id, BST_UID_SIZE);
+    memcpy(pkt->device_nonce, ctx->state.prv_device_nonce, BST_NONCE_SIZE);
+    pkt->external_confirmation_state = prv_confirmation_state(ctx);
 }
 
 /// Determine ssid, pwd, additional and ap_mode_pwd pointers
-static void prv_assign_data(const char* stored_data, size_t stored_data_len)
+static void prv_assign_data(bst_ctx_t* ctx, const char* stored_data, size_t stored_data_len)
 {
-    char** pointers[] = {&prv_instance.ssid, &prv_instance.pwd, &prv_instance.additional};
+    char** pointers[] = {&ctx->ssid, &ctx->pwd, &ctx->additional};
 
-    // data len = max(input len, sizeof prv_instance.storage - 4)
+    // data len = max(input len, sizeof ctx->storage - 4)
     if (stored_data_len > BST_STORAGE_RAM_SIZE-3)
         stored_data_len = BST_STORAGE_RAM_SIZE-3;
 
     // Copy new data
-    memcpy(prv_instance.storage, stored_data, stored_data_len);
+    memcpy(ctx->storage, stored_data, stored_data_len);
 
     // Set rest to 0
-    memset(prv_instance.storage+stored_data_len, 0, BST_STORAGE_RAM_SIZE-stored_data_len);
+    memset(ctx->storage+stored_data_len, 0, BST_STORAGE_RAM_SIZE-stored_data_len);
 
-    char* dataP = prv_instance.storage;
+    char* dataP = ctx->storage;
 
     for (int i=0; i < 3; ++i) {
         if (!*dataP) {
@@ -197,67 +534,243 @@ static void prv_assign_data(const char* stored_data, size_t stored_data_len)
         ++dataP;
     }
 
-    prv_instance.storage_len = stored_data_len;
+    ctx->storage_len = stored_data_len;
+
+    // A hint belongs to the previous data
+    memset(&ctx->connect_hint, 0, sizeof(ctx->connect_hint));
+    ctx->connect_hint.offset = (uint16_t)(dataP - ctx->storage);
 }
 
-void bst_setup(bst_connect_options options, const char* bst_data, size_t bst_data_len, const char *bound_key, size_t bound_key_len)
+/// Take the fast reconnect hint from the stored bootstrap data, if it ends with a valid record.
+static void prv_load_connect_hint(bst_ctx_t* ctx)
 {
-    // Clear prv_instance and assign options
-    memset(&prv_instance, 0, sizeof(instance_t));
-    prv_instance.options = options;
+    prv_connect_hint_record record;
+
+    if (ctx->connect_hint.offset + sizeof(record) > ctx->storage_len)
+        return;
 
-    prv_assign_data(bst_data, bst_data_len);
+    memcpy(&record, ctx->storage + ctx->connect_hint.offset, sizeof(record));
+    bst_crc_value crc = bst_crc16((const unsigned char*)&record.hint, sizeof(record.hint));
+    if (record.marker != BST_CONNECT_HINT_MARKER || memcmp(&crc, &record.crc, sizeof(crc)) != 0)
+        return;
+
+    ctx->connect_hint.hint = record.hint;
+    ctx->connect_hint.valid = true;
+}
+
+void bst_ctx_set_connect_hint(bst_ctx_t* ctx, const bst_connect_hint* hint)
+{
+    // Only the destination network is remembered, not the bootstrap network
+    if (!ctx->ssid || (ctx->state.state != BST_MODE_CONNECTING_TO_DEST &&
+                       ctx->state.state != BST_MODE_DESTINATION_CONNECTED))
+        return;
+
+    ctx->connect_hint.failed = false;
+
+    // Avoid a flash write if nothing changed
+    if (ctx->connect_hint.valid && memcmp(&ctx->connect_hint.hint, hint, sizeof(*hint)) == 0)
+        return;
+
+    ctx->connect_hint.hint = *hint;
+    ctx->connect_hint.valid = true;
+
+    // No space left after the strings, keep the hint until the next reboot only
+    prv_connect_hint_record record;
+    if (ctx->connect_hint.offset + sizeof(record) > BST_STORAGE_RAM_SIZE)
+        return;
+
+    record.marker = BST_CONNECT_HINT_MARKER;
+    record.hint = *hint;
+    record.crc = bst_crc16((const unsigned char*)&record.hint, sizeof(record.hint));
+    memcpy(ctx->storage + ctx->connect_hint.offset, &record, sizeof(record));
+    ctx->storage_len = ctx->connect_hint.offset + sizeof(record);
+
+    ctx->callbacks->store_bootstrap_data(ctx->user, ctx->storage, ctx->storage_len);
+}
+
+size_t bst_ctx_size()
+{
+    return sizeof(bst_ctx_t);
+}
+
+/// Set up a cleared context
+static void prv_setup(bst_ctx_t* ctx, const bst_callbacks* callbacks, void* user,
+                      bst_connect_options options, const char* bst_data, size_t bst_data_len, const char *bound_key, size_t bound_key_len)
+{
+    ctx->callbacks = callbacks;
+    ctx->user = user;
+    ctx->options = options;
+
+    // Events only report changes, start with the current state.
+    if (ctx->options.connection_events)
+        ctx->connection_event.state = (uint8_t)ctx->callbacks->get_connection_state(ctx->user);
+
+    prv_assign_data(ctx, bst_data, bst_data_len);
+    prv_load_connect_hint(ctx);
 
     if (bound_key_len > BST_BINDKEY_MAX_SIZE)
         bound_key_len = BST_BINDKEY_MAX_SIZE;
 
     if (bound_key_len) {
-        memcpy(prv_instance.crypto_secret, bound_key, bound_key_len);
-        prv_instance.crypto_secret_len = bound_key_len;
-    } else if (prv_instance.options.initial_crypto_secret) {
-        memcpy(prv_instance.crypto_secret, prv_instance.options.initial_crypto_secret, prv_instance.options.initial_crypto_secret_len);
-        prv_instance.crypto_secret_len = prv_instance.options.initial_crypto_secret_len;
+        memcpy(ctx->crypto_secret, bound_key, bound_key_len);
+        ctx->crypto_secret_len = bound_key_len;
+    } else if (ctx->options.initial_crypto_secret) {
+        memcpy(ctx->crypto_secret, ctx->options.initial_crypto_secret, ctx->options.initial_crypto_secret_len);
+        ctx->crypto_secret_len = ctx->options.initial_crypto_secret_len;
     }
+    prv_renew_crypto_ctx(ctx);
 
-    if (prv_instance.ssid) {
+    if (ctx->ssid) {
         // External confirmation is only required the first time. We are
         // bootstrapped already, so disable external confirmation.
-        if (prv_instance.options.external_confirmation_mode == BST_CONFIRM_REQUIRED_FIRST_START)
-            prv_instance.options.external_confirmation_mode = BST_CONFIRM_NOT_REQUIRED;
+        if (ctx->options.external_confirmation_mode == BST_CONFIRM_REQUIRED_FIRST_START)
+            ctx->options.external_confirmation_mode = BST_CONFIRM_NOT_REQUIRED;
         // Go into bootstrapped mode and connect to the destination network.
-        prv_enter_bootstrapped_mode();
-    } else if (prv_instance.options.bootstrap_ssid)
-        prv_enter_wait_for_bootstrap_mode(STATE_OK, NULL);
+        prv_enter_bootstrapped_mode(ctx);
+    } else if (ctx->options.bootstrap_ssid)
+        prv_enter_wait_for_bootstrap_mode(ctx, STATE_OK, NULL);
+}
+
+void bst_ctx_setup(bst_ctx_t* ctx, const bst_callbacks* callbacks, void* user,
+                   bst_connect_options options, const char* bst_data, size_t bst_data_len, const char *bound_key, size_t bound_key_len)
+{
+    memset(ctx, 0, sizeof(bst_ctx_t));
+    prv_setup(ctx, callbacks, user, options, bst_data, bst_data_len, bound_key, bound_key_len);
+}
+
+/**
+ * @brief Clear the context for a factory reset. bst_ctx_network_input() may write the
+ * ingress ring and input_stats at the same time, so those are kept. Received packets
+ * belong to the old session and are dropped by advancing the consumer index.
+ */
+static void prv_clear_for_factory_reset(bst_ctx_t* ctx)
+{
+    const size_t keep_start = offsetof(bst_ctx_t, input_stats);
+    const size_t keep_end = offsetof(bst_ctx_t, ingress) + sizeof(ctx->ingress);
+
+    memset(ctx, 0, keep_start);
+    memset((char*)ctx + keep_end, 0, sizeof(bst_ctx_t) - keep_end);
+    __atomic_store_n(&ctx->ingress.tail, __atomic_load_n(&ctx->ingress.head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief Return the time to wait for the next reconnection attempt, according to the
+ * backoff options, and count the attempt.
+ */
+static time_t prv_reconnect_delay(bst_ctx_t* ctx)
+{
+    const bst_connect_options* o = &ctx->options;
+    time_t delay = o->reconnect_backoff_base_ms ? o->reconnect_backoff_base_ms : o->timeout_connecting_state_ms;
+
+    if (o->reconnect_backoff == BST_BACKOFF_EXPONENTIAL) {
+        const time_t cap = o->reconnect_backoff_cap_ms ? o->reconnect_backoff_cap_ms : BST_BACKOFF_DEFAULT_CAP_MS;
+        const uint8_t multiplier = o->reconnect_backoff_multiplier ? o->reconnect_backoff_multiplier : 2;
+        for (uint8_t i=0; i < ctx->state.reconnect_attempts && delay < cap; ++i)
+            delay *= multiplier;
+        if (delay > cap)
+            delay = cap;
+    }
+
+    if (o->reconnect_jitter_percent) {
+        const uint8_t percent = o->reconnect_jitter_percent > 100 ? 100 : o->reconnect_jitter_percent;
+        delay -= (time_t)(ctx->callbacks->get_random(ctx->user) % ((uint64_t)delay*percent/100 + 1));
+    }
+
+    if (ctx->state.reconnect_attempts < UINT8_MAX)
+        ++ctx->state.reconnect_attempts;
+    return delay;
+}
+
+static void prv_connect_to_bootstrap(bst_ctx_t* ctx)
+{
+    prv_trace(ctx, BST_TRACE_CONNECT, 0);
+    ctx->callbacks->connect_to_wifi(ctx->user, ctx->options.bootstrap_ssid, ctx->options.bootstrap_key);
 }
 
+/**
+ * Ask the platform to look for the bootstrap network and do that again after
+ * bootstrap_discovery_interval_ms. Without a discover callback, the network is
+ * assumed to be in range.
+ */
+static void prv_discover_bootstrap_network(bst_ctx_t* ctx, time_t currentTime)
+{
+    ctx->state.timeout_connecting_bootstrap_app = currentTime + ctx->options.bootstrap_discovery_interval_ms;
+    __atomic_store_n(&ctx->discovery.seen, 0, __ATOMIC_RELAXED);
+    prv_trace(ctx, BST_TRACE_DISCOVER, ctx->discovery.channel);
+
+    if (ctx->callbacks->discover_bootstrap_network)
+        ctx->callbacks->discover_bootstrap_network(ctx->user, ctx->options.bootstrap_ssid, ctx->discovery.channel);
+    else
+        __atomic_store_n(&ctx->discovery.seen, 1, __ATOMIC_RELEASE);
+}
+
+void bst_ctx_bootstrap_network_not_found(bst_ctx_t* ctx)
+{
+    __atomic_store_n(&ctx->discovery.channel, 0, __ATOMIC_RELAXED);
+}
+
+void bst_ctx_bootstrap_network_found(bst_ctx_t* ctx, uint8_t channel)
+{
+    if (channel)
+        __atomic_store_n(&ctx->discovery.channel, channel, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->discovery.seen, 1, __ATOMIC_RELEASE);
+}
 
 /**
- * Try to connect to the wireless network (prv_instance.options.bootstrap_ssid) every
- * timeout_connecting_state_ms.
+ * Try to connect to the wireless network (ctx->options.bootstrap_ssid) every
+ * timeout_connecting_state_ms. With bootstrap_discovery_interval_ms, only look for it
+ * and connect after it was found.
  */
-static void prv_enter_wait_for_bootstrap_mode(prv_bst_error_state last_error_code, const char* last_error_message)
+static void prv_enter_wait_for_bootstrap_mode(bst_ctx_t* ctx, prv_bst_error_state last_error_code, const char* last_error_message)
 {
+    const uint8_t reconnect_attempts = ctx->state.reconnect_attempts;
+
     // Reset connection+flags state
-    memset(&(prv_instance.flags), 0, sizeof(prv_instance.flags));
-    memset(&(prv_instance.state), 0, sizeof(prv_instance.state));
-    prv_instance.state.error_log_msg = last_error_message;
-    prv_instance.state.last_error = last_error_code;
-    prv_instance.state.state = BST_MODE_CONNECTING_TO_BOOTSTRAP;
-    prv_instance.state.timeout_connecting_bootstrap_app = bst_get_system_time_ms() + prv_instance.options.timeout_connecting_state_ms;
+    memset(&(ctx->flags), 0, sizeof(ctx->flags));
+    memset(&(ctx->state), 0, sizeof(ctx->state));
+    ctx->state.error_log_msg = last_error_message;
+    ctx->state.last_error = last_error_code;
+    prv_set_state(ctx, BST_MODE_CONNECTING_TO_BOOTSTRAP);
+    ctx->state.reconnect_attempts = reconnect_attempts;
+
+    if (ctx->options.bootstrap_discovery_interval_ms) {
+        prv_discover_bootstrap_network(ctx, ctx->callbacks->get_system_time_ms(ctx->user));
+        return;
+    }
 
-    bst_connect_to_wifi(prv_instance.options.bootstrap_ssid, prv_instance.options.bootstrap_key);
+    ctx->state.timeout_connecting_bootstrap_app = ctx->callbacks->get_system_time_ms(ctx->user) + prv_reconnect_delay(ctx);
+    prv_connect_to_bootstrap(ctx);
 }
 
 /**
  * Sends an unencrypted message to the app with just a state byte.
  * @param state
  */
-static void prv_send_message(prv_bst_error_state state) {
+static void prv_send_message(bst_ctx_t* ctx, prv_bst_error_state state) {
     bst_udp_send_hello_pkt_t p;
-    const char hdr[] = BST_NETWORK_HEADER;
-    memcpy((char*)p.hdr, hdr, sizeof(BST_NETWORK_HEADER)-1);
+    prv_write_header(ctx, p.hdr);
     p.state_code = state;
-    bst_network_output((const char*)&p, sizeof(bst_udp_send_hello_pkt_t));
+    ctx->callbacks->network_output(ctx->user, (const char*)&p, sizeof(bst_udp_send_hello_pkt_t));
+}
+
+/**
+ * Connect to the destination network. Use the fast reconnect hint, unless there is none
+ * or the last attempt with it did not succeed: Fall back to a full scan and dhcp then.
+ */
+static void prv_connect_to_destination(bst_ctx_t* ctx)
+{
+    if (ctx->connect_hint.used)
+        ctx->connect_hint.failed = true;
+
+    ctx->connect_hint.used = ctx->connect_hint.valid && !ctx->connect_hint.failed &&
+            ctx->callbacks->connect_to_wifi_hinted;
+    prv_trace(ctx, BST_TRACE_CONNECT, ctx->connect_hint.used ? 2 : 1);
+
+    if (ctx->connect_hint.used)
+        ctx->callbacks->connect_to_wifi_hinted(ctx->user, ctx->ssid, ctx->pwd, &ctx->connect_hint.hint);
+    else
+        ctx->callbacks->connect_to_wifi(ctx->user, ctx->ssid, ctx->pwd);
 }
 
 /**
@@ -265,138 +778,246 @@ static void prv_send_message(prv_bst_error_state state) {
  * A timeout of timeout_connecting_state_ms will cancel the attempt and reenter
  * bootstrap mode instead.
  */
-static void prv_enter_bootstrapped_mode()
+static void prv_enter_bootstrapped_mode(bst_ctx_t* ctx)
 {
+    const uint8_t reconnect_attempts = ctx->state.reconnect_attempts;
+
     // Reset connection+flags state
-    memset(&(prv_instance.flags), 0, sizeof(prv_instance.flags));
-    memset(&(prv_instance.state), 0, sizeof(prv_instance.state));
-    prv_instance.state.state = BST_MODE_CONNECTING_TO_DEST;
-    prv_instance.state.timeout_connecting_destination = bst_get_system_time_ms() + prv_instance.options.timeout_connecting_state_ms;
+    memset(&(ctx->flags), 0, sizeof(ctx->flags));
+    memset(&(ctx->state), 0, sizeof(ctx->state));
+    prv_set_state(ctx, BST_MODE_CONNECTING_TO_DEST);
+    ctx->state.reconnect_attempts = reconnect_attempts;
+    ctx->state.timeout_connecting_destination = ctx->callbacks->get_system_time_ms(ctx->user) + prv_reconnect_delay(ctx);
 
-    bst_connect_to_wifi(prv_instance.ssid, prv_instance.pwd);
+    prv_connect_to_destination(ctx);
 }
 
-void bst_periodic()
+/**
+ * @brief Execute the requests of processed packets.
+ * @return Return true if the mode changed and bst_ctx_periodic() should return.
+ */
+static bool prv_handle_requests(bst_ctx_t* ctx)
 {
-    if (!prv_instance.options.bootstrap_ssid || !prv_instance.options.initial_crypto_secret)
-        return;
+    if (ctx->flags.request_bind) {
+        ctx->flags.request_bind = false;
+        ctx->state.last_error = STATE_OK;
 
-    if (prv_instance.flags.request_factory_reset) {
-        prv_instance.flags.request_factory_reset = false;
-        BST_DBG("request_factory_reset\n");
-        bst_connect_options o = prv_instance.options;
-        memset(&prv_instance, 0, sizeof(instance_t));
+        BST_DBG("CMD_BIND %s %s\n", ctx->crypto_secret, ctx->options.bootstrap_ssid);
 
-        bst_store_bootstrap_data(NULL, 0);
-        bst_store_crypto_secret(NULL, 0);
-        bst_setup(o,NULL,0,NULL,0);
-        return;
+        ctx->callbacks->store_crypto_secret(ctx->user, ctx->crypto_secret, ctx->crypto_secret_len);
+
+        // The response to the client is the wifi list
+        ctx->flags.request_wifi_list = true;
     }
 
-    if (prv_instance.flags.request_bind) {
-        prv_instance.flags.request_bind = false;
-        prv_instance.state.last_error = STATE_OK;
+    if (ctx->flags.request_wifi_list) {
+        ctx->flags.request_wifi_list = false;
+        BST_DBG("request_wifi_list\n");
+#ifdef BST_WIFI_SCAN_CACHE
+        // Answer immediately if the last scan is recent enough
+        if (prv_scan_cache_valid(ctx))
+            prv_send_wifi_list(ctx, ctx->scan_cache.list);
+        else
+#endif
+        {
+            ctx->flags.wifi_list_response_pending = true;
+            ctx->callbacks->request_wifi_network_list(ctx->user);
+        }
+    }
+
+    if (ctx->flags.request_set_wifi) {
+        prv_send_message(ctx, STATE_BOOTSTRAP_OK);
+        ctx->callbacks->store_bootstrap_data(ctx->user, ctx->storage, ctx->storage_len);
+        prv_enter_bootstrapped_mode(ctx);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Return the connection state reported by bst_ctx_connection_event() or poll
+ * bst_get_connection_state() if the connection_events option is not set.
+ */
+static bst_connect_state prv_connection_state(bst_ctx_t* ctx)
+{
+    if (!ctx->options.connection_events)
+        return ctx->callbacks->get_connection_state(ctx->user);
 
-        BST_DBG("CMD_BIND %s %s\n", prv_instance.crypto_secret, prv_instance.options.bootstrap_ssid);
+    __atomic_store_n(&ctx->connection_event.changed, 0, __ATOMIC_RELAXED);
+    return (bst_connect_state)__atomic_load_n(&ctx->connection_event.state, __ATOMIC_ACQUIRE);
+}
 
-        bst_store_crypto_secret(prv_instance.crypto_secret, prv_instance.crypto_secret_len);
+void bst_ctx_connection_event(bst_ctx_t* ctx, bst_connect_state state)
+{
+    const uint8_t last = __atomic_load_n(&ctx->connection_event.state, __ATOMIC_RELAXED);
+    const bool failed = last != BST_STATE_NO_CONNECTION && last < BST_STATE_CONNECTED;
 
-        // Send response to client
-        bst_request_wifi_network_list();
+    // Keep a failure until bst_ctx_periodic() has seen it.
+    if (state == BST_STATE_NO_CONNECTION && failed &&
+            __atomic_load_n(&ctx->connection_event.changed, __ATOMIC_RELAXED))
         return;
-    }
 
-    if (prv_instance.flags.request_wifi_list) {
-        prv_instance.flags.request_wifi_list = false;
-        BST_DBG("request_wifi_list\n");
-        bst_request_wifi_network_list();
+    __atomic_store_n(&ctx->connection_event.state, (uint8_t)state, __ATOMIC_RELEASE);
+    __atomic_store_n(&ctx->connection_event.changed, 1, __ATOMIC_RELEASE);
+}
+
+void bst_ctx_periodic(bst_ctx_t* ctx)
+{
+    if (!ctx->options.bootstrap_ssid || !ctx->options.initial_crypto_secret)
         return;
-    }
 
-    if (prv_instance.flags.request_set_wifi) {
-        prv_send_message(STATE_BOOTSTRAP_OK);
-        bst_store_bootstrap_data(prv_instance.storage, prv_instance.storage_len);
-        prv_enter_bootstrapped_mode();
+    if (ctx->flags.request_factory_reset) {
+        ctx->flags.request_factory_reset = false;
+        BST_DBG("request_factory_reset\n");
+        const bst_callbacks* callbacks = ctx->callbacks;
+        void* user = ctx->user;
+        bst_connect_options o = ctx->options;
+        bst_timer timer = ctx->timer;
+
+        callbacks->store_bootstrap_data(user, NULL, 0);
+        callbacks->store_crypto_secret(user, NULL, 0);
+        prv_clear_for_factory_reset(ctx);
+        prv_setup(ctx, callbacks, user, o,NULL,0,NULL,0);
+        // Stay in the scheduler
+        ctx->timer = timer;
         return;
     }
 
-    time_t currentTime = bst_get_system_time_ms();
-    bst_connect_state currentConnectionState = bst_get_connection_state();
+    // Process every received packet and its request, so that back-to-back
+    // packets are not dropped. Stop if a request changed the mode.
+    for (;;) {
+        if (prv_handle_requests(ctx))
+            return;
+
+        const uint8_t tail = ctx->ingress.tail;
+        if (tail == __atomic_load_n(&ctx->ingress.head, __ATOMIC_ACQUIRE))
+            break;
+
+        prv_ingress_slot* slot = &ctx->ingress.slots[tail & (BST_INGRESS_RING_SLOTS-1)];
+        prv_process_packet(ctx, (char*)&slot->pkt, slot->len);
+
+        // Hand the slot back to the producer
+        __atomic_store_n(&ctx->ingress.tail, (uint8_t)(tail+1), __ATOMIC_RELEASE);
+    }
+
+    time_t currentTime = ctx->callbacks->get_system_time_ms(ctx->user);
+    bst_connect_state currentConnectionState = prv_connection_state(ctx);
 
-    switch (prv_instance.state.state) {
+    switch (ctx->state.state) {
     case BST_MODE_CONNECTING_TO_BOOTSTRAP:
         if (currentConnectionState == BST_STATE_CONNECTED ||
                 currentConnectionState == BST_STATE_CONNECTED_ADVANCED) {
-            prv_instance.state.state = BST_MODE_WAITING_FOR_DATA;
+            prv_set_state(ctx, BST_MODE_WAITING_FOR_DATA);
+            ctx->state.reconnect_attempts = 0;
+#ifdef BST_WIFI_SCAN_CACHE
+            // The first background refresh is due after half of the ttl
+            ctx->scan_cache.next_refresh = currentTime + ctx->options.wifi_scan_cache_ttl_ms/2;
+            ctx->scan_cache.refreshes = 0;
+#endif
             // Notify the user that we have a bootstrap connection now.
-            bst_connected_to_bootstrap_network();
+            ctx->callbacks->connected_to_bootstrap_network(ctx->user);
             // Send HELLO message to notify the bootstrap app that we are online and ready
             // This is not necessary because the app will detect the device anyway
             // by periodically requesting neighbour wifi lists from but will fasten up things.
-            prv_send_message(STATE_HELLO);
+            prv_send_message(ctx, STATE_HELLO);
             // No break here, we go straight to the next switch state
+        } else if (ctx->options.bootstrap_discovery_interval_ms &&
+                   __atomic_exchange_n(&ctx->discovery.seen, 0, __ATOMIC_ACQUIRE)) {
+            // The platform has seen the bootstrap network, connect to it now.
+            ctx->state.timeout_connecting_bootstrap_app = currentTime + prv_reconnect_delay(ctx);
+            prv_connect_to_bootstrap(ctx);
+            break;
         } else {
             // Check if it is time to start a new connection attempt.
-            if (prv_instance.state.timeout_connecting_bootstrap_app > currentTime)
+            if (ctx->state.timeout_connecting_bootstrap_app > currentTime)
                 break;
-            prv_instance.state.timeout_connecting_bootstrap_app = currentTime + prv_instance.options.timeout_connecting_state_ms;
 
             // We are not connected and in wait-for-bootstrap mode.
-            if (!prv_instance.ssid ||
-                    ++prv_instance.state.count_connection_attempts <= prv_instance.options.retry_connecting_to_bootstrap_network)
+            if (!ctx->ssid ||
+                    ++ctx->state.count_connection_attempts <= ctx->options.retry_connecting_to_bootstrap_network)
             { // We are not bootstrapped so far. Try to connect to a bootstrap network.
-                bst_connect_to_wifi(prv_instance.options.bootstrap_ssid,
-                                    prv_instance.options.bootstrap_key);
+                if (ctx->options.bootstrap_discovery_interval_ms) {
+                    prv_discover_bootstrap_network(ctx, currentTime);
+                    break;
+                }
+                ctx->state.timeout_connecting_bootstrap_app = currentTime + prv_reconnect_delay(ctx);
+                prv_connect_to_bootstrap(ctx);
             } else {
                 // If we are already bootstrapped (ssid is known)
                 // and we tried count_connection_attempts times to reach the
                 // bootstrap network, try to connect to the destination network instead.
-                prv_enter_bootstrapped_mode();
+                prv_enter_bootstrapped_mode(ctx);
             }
             break;
         }
     case BST_MODE_WAITING_FOR_DATA:
         // We lost the connection, change the internal state accordingly.
         if (currentConnectionState != BST_STATE_CONNECTED) {
-            prv_instance.state.state = BST_MODE_CONNECTING_TO_BOOTSTRAP;
+            prv_set_state(ctx, BST_MODE_CONNECTING_TO_BOOTSTRAP);
             break;
         }
 
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+        // Use idle calls to prepare the keystream for the next response.
+        prv_precompute_keystream(ctx);
+#endif
+
+#ifdef BST_WIFI_SCAN_CACHE
+        {   // Refresh the scan cache before it expires, so that the next app gets an immediate answer.
+            time_t refresh;
+            if (prv_scan_cache_refresh_time(ctx, &refresh) && refresh <= currentTime) {
+                ++ctx->scan_cache.refreshes;
+                ctx->scan_cache.next_refresh = currentTime + ctx->options.wifi_scan_cache_ttl_ms/2;
+                ctx->callbacks->request_wifi_network_list(ctx->user);
+            }
+        }
+#endif
+
         // Check if it is time to timeout waiting for data.
-        if (prv_instance.state.timeout_connecting_bootstrap_app > currentTime)
+        if (ctx->state.timeout_connecting_bootstrap_app > currentTime)
             break;
-        prv_instance.state.timeout_connecting_bootstrap_app = currentTime + prv_instance.options.timeout_connecting_state_ms;
+        ctx->state.timeout_connecting_bootstrap_app = currentTime + ctx->options.timeout_connecting_state_ms;
 
         // We are connected to the app which should bootstrap us
         // but no bootstrap session is ongoing. The app should not
         // be able to keep the device from connecting to the already
         // stored destination SSID. Therefore we enter the bootstrapped
         // mode now.
-        if (prv_instance.ssid && !prv_is_app_session_valid())
-            prv_enter_bootstrapped_mode();
+        if (ctx->ssid && !prv_is_app_session_valid(ctx))
+            prv_enter_bootstrapped_mode(ctx);
 
         break;
     case BST_MODE_CONNECTING_TO_DEST:
         if (currentConnectionState == BST_STATE_CONNECTED ||
                 currentConnectionState == BST_STATE_CONNECTED_ADVANCED) {
-            prv_instance.state.state = BST_MODE_DESTINATION_CONNECTED;
+            prv_set_state(ctx, BST_MODE_DESTINATION_CONNECTED);
+            ctx->state.reconnect_attempts = 0;
+            ctx->connect_hint.used = false;
 
-            if (prv_instance.options.need_advanced_connection) {
+            if (ctx->options.need_advanced_connection) {
                 // Start an advanced connection immediatelly after the wireless
                 // connection has been established, without waiting for a timeout.
-                prv_instance.state.timeout_connecting_advanced = 0;
-                prv_instance.state.count_connection_attempts = 0;
-                prv_instance.state.error_log_msg = NULL;
-                prv_instance.state.last_error = STATE_OK;
+                ctx->state.timeout_connecting_advanced = 0;
+                ctx->state.count_connection_attempts = 0;
+                ctx->state.error_log_msg = NULL;
+                ctx->state.last_error = STATE_OK;
             }
             // No break here, we go straight to the next switch state
-        } else if (currentTime > prv_instance.state.timeout_connecting_destination) {
-            prv_instance.state.timeout_connecting_destination = prv_instance.options.timeout_connecting_state_ms + currentTime;
-            if (++prv_instance.state.count_connection_attempts >= prv_instance.options.retry_connecting_to_destination_network) {
-                prv_enter_wait_for_bootstrap_mode(STATE_ERROR_WIFI_NOT_FOUND,
-                                                  prv_instance.state.error_log_msg?prv_instance.state.error_log_msg:ERR_FAILED_WIFI_NOT_FOUND);
+        } else if (ctx->connect_hint.used && currentConnectionState != BST_STATE_NO_CONNECTION &&
+                   currentConnectionState < BST_STATE_CONNECTED) {
+            // The access point of the hint is gone or changed its channel. This is not
+            // a reason to go back to bootstrap mode, connect with a full scan instead.
+            ctx->state.timeout_connecting_destination = ctx->options.timeout_connecting_state_ms + currentTime;
+            prv_connect_to_destination(ctx);
+            break;
+        } else if (currentTime > ctx->state.timeout_connecting_destination) {
+            ctx->state.timeout_connecting_destination = prv_reconnect_delay(ctx) + currentTime;
+            if (++ctx->state.count_connection_attempts >= ctx->options.retry_connecting_to_destination_network) {
+                prv_enter_wait_for_bootstrap_mode(ctx, STATE_ERROR_WIFI_NOT_FOUND,
+                                                  ctx->state.error_log_msg?ctx->state.error_log_msg:ERR_FAILED_WIFI_NOT_FOUND);
             } else {
-                bst_connect_to_wifi(prv_instance.ssid, prv_instance.pwd);
+                prv_connect_to_destination(ctx);
             }
             break;
         }
@@ -405,61 +1026,159 @@ void bst_periodic()
         switch (currentConnectionState)
         {
             case BST_STATE_FAILED_SSID_NOT_FOUND:
-                prv_enter_wait_for_bootstrap_mode(STATE_ERROR_WIFI_NOT_FOUND,
-                                                  prv_instance.state.error_log_msg?prv_instance.state.error_log_msg:ERR_FAILED_WIFI_NOT_FOUND);
+                prv_enter_wait_for_bootstrap_mode(ctx, STATE_ERROR_WIFI_NOT_FOUND,
+                                                  ctx->state.error_log_msg?ctx->state.error_log_msg:ERR_FAILED_WIFI_NOT_FOUND);
                 break;
             case BST_STATE_FAILED_CREDENTIALS_WRONG:
-                prv_enter_wait_for_bootstrap_mode(STATE_ERROR_WIFI_CREDENTIALS_WRONG,
-                                                  prv_instance.state.error_log_msg?prv_instance.state.error_log_msg:ERR_FAILED_WIFI_CRED);
+                prv_enter_wait_for_bootstrap_mode(ctx, STATE_ERROR_WIFI_CREDENTIALS_WRONG,
+                                                  ctx->state.error_log_msg?ctx->state.error_log_msg:ERR_FAILED_WIFI_CRED);
                 break;
             case BST_STATE_FAILED_ADVANCED:
-                prv_enter_wait_for_bootstrap_mode(STATE_ERROR_ADVANCED,
-                                                  prv_instance.state.error_log_msg?prv_instance.state.error_log_msg:ERR_FAILED_ADVANCED);
+                prv_enter_wait_for_bootstrap_mode(ctx, STATE_ERROR_ADVANCED,
+                                                  ctx->state.error_log_msg?ctx->state.error_log_msg:ERR_FAILED_ADVANCED);
                 break;
             case BST_STATE_CONNECTED:
-                if (prv_instance.options.need_advanced_connection) {
+                if (ctx->options.need_advanced_connection) {
                     // The advanced connection failed, go back to discover mode after n attempts
-                    if (prv_instance.state.count_connection_attempts > prv_instance.options.retry_connecting_to_destination_network) {
-                        prv_enter_wait_for_bootstrap_mode(STATE_ERROR_ADVANCED,
-                                                          prv_instance.state.error_log_msg?prv_instance.state.error_log_msg:ERR_FAILED_ADVANCED);
+                    if (ctx->state.count_connection_attempts > ctx->options.retry_connecting_to_destination_network) {
+                        prv_enter_wait_for_bootstrap_mode(ctx, STATE_ERROR_ADVANCED,
+                                                          ctx->state.error_log_msg?ctx->state.error_log_msg:ERR_FAILED_ADVANCED);
                         break;
                     }
 
-                    if (currentTime >= prv_instance.state.timeout_connecting_advanced) {
-                        ++prv_instance.state.count_connection_attempts;
-                        prv_instance.state.timeout_connecting_advanced = prv_instance.options.timeout_connecting_state_ms + currentTime;
-                        bst_connect_advanced(prv_instance.additional);
+                    if (currentTime >= ctx->state.timeout_connecting_advanced) {
+                        ++ctx->state.count_connection_attempts;
+                        ctx->state.timeout_connecting_advanced = ctx->options.timeout_connecting_state_ms + currentTime;
+                        ctx->callbacks->connect_advanced(ctx->user, ctx->additional);
                     }
                 }
                 break;
             case BST_STATE_CONNECTED_ADVANCED:
-                prv_instance.state.error_log_msg = NULL;
-                prv_instance.state.last_error = STATE_OK;
+                ctx->state.error_log_msg = NULL;
+                ctx->state.last_error = STATE_OK;
                 break;
 
             case BST_STATE_CONNECTING:
             case BST_STATE_NO_CONNECTION:
             default:
                 // We lost the connection, change the internal state accordingly.
-                prv_instance.state.state = BST_MODE_CONNECTING_TO_DEST;
+                prv_set_state(ctx, BST_MODE_CONNECTING_TO_DEST);
                 break;
         } // end switch(currentConnectionState)
         break;
     default:
         break;
-    } // end switch(prv_instance.state.state)
+    } // end switch(ctx->state.state)
 }
 
-void bst_network_input(const char* data, size_t len)
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+static inline bool prv_keystream_incomplete(bst_ctx_t* ctx)
 {
-    if (prv_instance.state.state!=BST_MODE_WAITING_FOR_DATA ||
-            len < sizeof(bst_udp_receive_pkt_t)) {
-        BST_DBG("net: too short\n");
+    return ctx->state.time_nonce_valid &&
+            (!prv_keystream_matches(ctx, ctx->state.prv_app_nonce) ||
+             ctx->keystream.len < sizeof(ctx->keystream.data));
+}
+#endif
+
+static inline void prv_earlier_deadline(time_t* deadline, time_t t)
+{
+    if (t < *deadline)
+        *deadline = t;
+}
+
+time_t bst_ctx_next_wakeup_ms(bst_ctx_t* ctx)
+{
+    const time_t currentTime = ctx->callbacks->get_system_time_ms(ctx->user);
+    // If the connection state is polled, look at it at least every BST_MAX_SLEEP_MS.
+    time_t deadline = currentTime + (ctx->options.connection_events ? BST_MAX_SLEEP_EVENTS_MS : BST_MAX_SLEEP_MS);
+
+    if (!ctx->options.bootstrap_ssid || !ctx->options.initial_crypto_secret)
+        return deadline;
+
+    // Pending requests, received packets and connection changes are handled immediately.
+    if (ctx->flags.request_factory_reset || ctx->flags.request_bind ||
+            ctx->flags.request_wifi_list || ctx->flags.request_set_wifi ||
+            ctx->ingress.tail != __atomic_load_n(&ctx->ingress.head, __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&ctx->connection_event.changed, __ATOMIC_ACQUIRE))
+        return currentTime;
+
+    switch (ctx->state.state) {
+    case BST_MODE_CONNECTING_TO_BOOTSTRAP:
+        if (ctx->options.bootstrap_discovery_interval_ms &&
+                __atomic_load_n(&ctx->discovery.seen, __ATOMIC_ACQUIRE))
+            return currentTime;
+        prv_earlier_deadline(&deadline, ctx->state.timeout_connecting_bootstrap_app);
+        break;
+    case BST_MODE_WAITING_FOR_DATA:
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+        if (prv_keystream_incomplete(ctx))
+            return currentTime;
+#endif
+#ifdef BST_WIFI_SCAN_CACHE
+        {
+            time_t refresh;
+            if (prv_scan_cache_refresh_time(ctx, &refresh))
+                prv_earlier_deadline(&deadline, refresh);
+        }
+#endif
+        prv_earlier_deadline(&deadline, ctx->state.timeout_connecting_bootstrap_app);
+        break;
+    case BST_MODE_CONNECTING_TO_DEST:
+        // bst_ctx_periodic() waits until this timeout is exceeded
+        prv_earlier_deadline(&deadline, ctx->state.timeout_connecting_destination+1);
+        break;
+    case BST_MODE_DESTINATION_CONNECTED:
+        if (ctx->options.need_advanced_connection)
+            prv_earlier_deadline(&deadline, ctx->state.timeout_connecting_advanced);
+        break;
+    default:
+        break;
+    }
+
+    return deadline < currentTime ? currentTime : deadline;
+}
+
+/**
+ * @brief Check and apply one received packet. The packet is decrypted in place.
+ * Called by bst_ctx_periodic() for every packet of the ingress ring.
+ * @param data The packet. bst_ctx_network_input() ensures a valid minimum and maximum length.
+ * @param len The packet length.
+ */
+static void prv_process_packet(bst_ctx_t* ctx, char* data, size_t len)
+{
+    bst_input_stats* stats = &ctx->input_stats;
+
+    if (ctx->state.state!=BST_MODE_WAITING_FOR_DATA) {
+        BST_DBG("net: not waiting for data\n");
+        prv_count_rejected(ctx, rejected_state);
         return;
     }
 
+    // Reject everything that can not be accepted before doing any crypto work.
     bst_udp_receive_pkt_t* pkt = (bst_udp_receive_pkt_t*)data;
-    if (!prv_check_header_and_decrypt(pkt, len)) {
+    if (!prv_check_header(pkt)) {
+        BST_DBG("net: header wrong\n");
+        prv_count_rejected(ctx, rejected_header);
+        return;
+    }
+
+    if (len != prv_expected_length(pkt->command_code)) {
+        BST_DBG("net: cmd %d with wrong length %d\n", pkt->command_code, len);
+        prv_count_rejected(ctx, rejected_length);
+        return;
+    }
+
+    if (!prv_could_be_accepted(ctx, pkt))
+        return;
+
+    if (!prv_take_input_token(ctx)) {
+        BST_DBG("net: rate limited\n");
+        prv_count_rejected(ctx, rejected_rate);
+        return;
+    }
+
+    if (!prv_check_crc_and_decrypt(ctx, pkt, len)) {
+        prv_count_rejected(ctx, rejected_crc);
         BST_DBG("net: crc wrong\n");
         #ifdef BST_DEBUG
         const size_t offset = sizeof(bst_udp_receive_pkt_t);
@@ -474,179 +1193,472 @@ void bst_network_input(const char* data, size_t len)
       return;
     }
 
+    // Only failed checks use up the bucket
+    prv_return_input_token(ctx);
+    ++stats->accepted;
+    prv_trace(ctx, BST_TRACE_PACKET_ACCEPTED, pkt->command_code);
+
     switch(pkt->command_code) {
         case CMD_HELLO: {
             bst_udp_hello_receive_pkt_t* pkt_hello = (bst_udp_hello_receive_pkt_t*)data;
-            if (len < sizeof(bst_udp_hello_receive_pkt_t)) {
-                BST_DBG("net: hello too short\n");
-                return;
-            }
-
-            // To protect from DOS we do not accept rapidly changing app_nonces.
-            // Keep your app session for at least 1min.
-            if (prv_enter_and_keep_app_session(pkt_hello->app_nonce)) {
+            if (prv_enter_and_keep_app_session(ctx, pkt_hello->app_nonce)) {
                 // A new session is opened or the current session is renewed (new device nonce).
+                // Answer with the protocol version of the app.
+                ctx->state.protocol_version = prv_header_version(pkt_hello->hdr);
                 // Send the wifi list as response to the app now.
-                prv_instance.flags.request_wifi_list = true;
-            } else {
-                BST_DBG("net: hello. no app session\n");
+                ctx->flags.request_wifi_list = true;
             }
             break;
         }
         case CMD_BIND: {
-            // Exit if there is no app session opened
-            if (!prv_is_app_session_valid()) {
-                BST_DBG("net: no app session\n");
-                return;
-            }
             bst_udp_bind_receive_pkt_t* pkt_bind = (bst_udp_bind_receive_pkt_t*)data;
-            if (len < sizeof(bst_udp_bind_receive_pkt_t)) {
-                BST_DBG("net: bind too short\n");
-                return;
-            }
-
-            if (prv_instance.flags.request_bind)
-                break;
+            uint8_t new_bind_key_len = pkt_bind->new_bind_key_len;
+            if (new_bind_key_len > BST_BINDKEY_MAX_SIZE)
+                new_bind_key_len = BST_BINDKEY_MAX_SIZE;
 
-            memcpy(prv_instance.crypto_secret, pkt_bind->new_bind_key, pkt_bind->new_bind_key_len);
-            prv_instance.crypto_secret_len = pkt_bind->new_bind_key_len;
-            prv_instance.flags.request_bind = true;
+            memcpy(ctx->crypto_secret, pkt_bind->new_bind_key, new_bind_key_len);
+            ctx->crypto_secret_len = new_bind_key_len;
+            prv_renew_crypto_ctx(ctx);
+            ctx->flags.request_bind = true;
 
             break;
         }
         case CMD_SET_DATA: {
-            // Exit if there is no app session opened
-            if (!prv_is_app_session_valid()) {
-                BST_DBG("net: no app session\n");
-                return;
-            }
-
             bst_udp_bootstrap_receive_pkt_t* pkt_bst_data = (bst_udp_bootstrap_receive_pkt_t*)data;
-            if (len < sizeof(bst_udp_bootstrap_receive_pkt_t)) {
-                BST_DBG("net: setdata too short\n");
-                return;
-            }
+            prv_assign_data(ctx, pkt_bst_data->bootstrap_data, len-sizeof(bst_udp_receive_pkt_t));
 
-            if (prv_instance.options.external_confirmation_mode != BST_CONFIRM_NOT_REQUIRED &&
-                    !prv_instance.flags.external_confirmation) {
-                BST_DBG("net: setdata confirmation missing\n");
-                return;
-            }
+            ctx->flags.request_set_wifi = true;
+            break;
+        }
+    }
+}
 
-            if (prv_instance.flags.request_set_wifi)
-                break;
+void bst_ctx_network_input(bst_ctx_t* ctx, const char* data, size_t len)
+{
+    // Producer side of the ingress ring. Only writes ingress.head,
+    // the slot it owns and input_stats.rejected_ingress.
+    const uint8_t head = ctx->ingress.head;
+    const uint8_t tail = __atomic_load_n(&ctx->ingress.tail, __ATOMIC_ACQUIRE);
+
+    if (len < sizeof(bst_udp_receive_pkt_t) || len > sizeof(bst_udp_receive_any_pkt_t) ||
+            (uint8_t)(head - tail) >= BST_INGRESS_RING_SLOTS) {
+        BST_DBG("net: dropped, len(%d)\n", len);
+        ++ctx->input_stats.rejected_ingress;
+        return;
+    }
 
-            prv_assign_data(pkt_bst_data->bootstrap_data, len-sizeof(bst_udp_receive_pkt_t));
+    prv_ingress_slot* slot = &ctx->ingress.slots[head & (BST_INGRESS_RING_SLOTS-1)];
+    memcpy(&slot->pkt, data, len);
+    slot->len = (uint16_t)len;
 
-            prv_instance.flags.request_set_wifi = true;
-            break;
+    // Publish the slot content together with the new head
+    __atomic_store_n(&ctx->ingress.head, (uint8_t)(head+1), __ATOMIC_RELEASE);
+}
+
+const bst_input_stats* bst_ctx_get_input_stats(bst_ctx_t* ctx)
+{
+    return &ctx->input_stats;
+}
+
+#ifdef BST_TRACE
+/// Copy up to max records, starting with the oldest, and remove them if consume is set.
+static size_t prv_trace_read(bst_ctx_t* ctx, bst_trace_record* out, size_t max, bool consume)
+{
+    uint16_t tail = ctx->trace.tail;
+    size_t count = 0;
+
+    for (; count < max && tail != ctx->trace.head; ++count, ++tail)
+        out[count] = ctx->trace.records[tail & (BST_TRACE_SLOTS-1)];
+
+    if (consume)
+        ctx->trace.tail = tail;
+    return count;
+}
+
+size_t bst_ctx_trace_drain(bst_ctx_t* ctx, bst_trace_record* out, size_t max)
+{
+    return prv_trace_read(ctx, out, max, true);
+}
+
+size_t bst_ctx_trace_snapshot(bst_ctx_t* ctx, bst_trace_record* out, size_t max)
+{
+    return prv_trace_read(ctx, out, max, false);
+}
+#endif
+
+#if defined(BST_TRACE) && defined(BST_TRACE_IN_WIFI_LIST)
+/// Serialize the newest trace records that fit into "space" bytes, for a wifi list response:
+/// A count byte, then per record the time (4 bytes, network byte order), event and arg.
+/// The records stay in the trace ring.
+static size_t prv_serialize_trace(bst_ctx_t* ctx, char* out, size_t space)
+{
+    if (!space)
+        return 0;
+
+    size_t count = (uint16_t)(ctx->trace.head - ctx->trace.tail);
+    if (count > (space-1)/6)
+        count = (space-1)/6;
+    if (count > UINT8_MAX)
+        count = UINT8_MAX;
+
+    *out++ = (char)count;
+    for (uint16_t i = (uint16_t)(ctx->trace.head - count); i != ctx->trace.head; ++i) {
+        const bst_trace_record* r = &ctx->trace.records[i & (BST_TRACE_SLOTS-1)];
+        *out++ = (char)(r->time_ms >> 24);
+        *out++ = (char)(r->time_ms >> 16);
+        *out++ = (char)(r->time_ms >> 8);
+        *out++ = (char)r->time_ms;
+        *out++ = (char)r->event;
+        *out++ = (char)r->arg;
+    }
+    return 1 + count*6;
+}
+#endif
+
+/// Return the smallest of the BST_WIFI_LIST_BUCKET_SIZES (or BST_NETWORK_PACKET_SIZE)
+/// that holds used_len bytes.
+static size_t prv_wifi_list_bucket_size(size_t used_len)
+{
+    static const uint16_t buckets[] = {BST_WIFI_LIST_BUCKET_SIZES};
+
+    for (size_t i=0; i < sizeof(buckets)/sizeof(buckets[0]); ++i) {
+        if (used_len <= buckets[i] && buckets[i] < sizeof(bst_udp_send_pkt_t))
+            return buckets[i];
+    }
+    return sizeof(bst_udp_send_pkt_t);
+}
+
+static inline bool prv_is_bootstrap_ssid(bst_ctx_t* ctx, const bst_wifi_list_entry_t* entry)
+{
+    return memcmp(entry->ssid, ctx->options.bootstrap_ssid, strlen(entry->ssid))==0;
+}
+
+/**
+ * @brief Serialize wifi list entries, starting with *it, until the next entry does not fit.
+ * Entry format: strength in percent, encryption mode, ssid with trailing 0.
+ * Compact entry format (protocol version 3): strength/2 in the upper 6 bits and the
+ * encryption mode in the lower 2 bits of one byte, ssid with trailing 0.
+ * The bootstrap network is skipped.
+ * @param buffer The output buffer or NULL to only count the bytes.
+ * @param capacity The buffer size.
+ * @param it In: The first entry. Out: The first entry that did not fit or NULL.
+ * @param entries Incremented for every written entry.
+ * @param compact Use the compact entry format.
+ * @return The used bytes.
+ */
+static size_t prv_serialize_wifi_list(bst_ctx_t* ctx, char* buffer, size_t capacity, bst_wifi_list_entry_t** it,
+                                      uint8_t* entries, bool compact)
+{
+    const size_t overhead = compact ? 2 : 3;
+    size_t used = 0;
+
+    while (*it) {
+        const bst_wifi_list_entry_t* entry = *it;
+
+        if (prv_is_bootstrap_ssid(ctx, entry)) {
+            *it = entry->next;
+            continue;
         }
 
-        default:
-            BST_DBG("net: UNKNOWN cmd %d", pkt->command_code);
+        // strength + enc mode + ssid + trailing 0
+        size_t ssid_len = strlen(entry->ssid);
+        if (used+ssid_len+overhead > capacity)
             break;
+
+        if (buffer) {
+            char* p = buffer+used;
+            if (compact) {
+                const uint8_t strength = entry->strength_percent > 100 ? 100 : entry->strength_percent;
+                *p++ = (char)((strength/2) << 2 | (entry->encryption_mode & 0x3));
+            } else {
+                *p++ = entry->strength_percent;
+                *p++ = entry->encryption_mode;
+            }
+            memcpy(p, entry->ssid, ssid_len);
+            p[ssid_len] = 0;
+        }
+        used += ssid_len + overhead;
+        ++*entries;
+        *it = entry->next;
     }
+
+    return used;
 }
 
-void bst_wifi_network_list(bst_wifi_list_entry_t* list)
+/**
+ * @brief Copy the list into sorted, strongest first, and only keep the strongest
+ * entry per ssid. If there are more than BST_WIFI_LIST_MAX_ENTRIES different ssids,
+ * the weakest are dropped. The copies are linked in order.
+ * @return The first copy or NULL.
+ */
+static bst_wifi_list_entry_t* prv_sort_and_dedup_wifi_list(bst_ctx_t* ctx, const bst_wifi_list_entry_t* list,
+                                                           bst_wifi_list_entry_t* sorted)
 {
-    if (prv_instance.state.state != BST_MODE_WAITING_FOR_DATA)
-        return;
+    size_t count = 0;
 
-    // Create buffer that looks like this:
-    // 0: list size
-    // 1: strength of first wifi
-    // 2..x: ssid of first wifi with training 0.
-    // x+1: strength of second wifi
-    // x+2..y: ssid of second wifi with training 0.
-    // ...
+    for (; list; list = list->next) {
+        if (prv_is_bootstrap_ssid(ctx, list))
+            continue;
 
-    uint8_t wifi_list_entries = 0;
-    uint8_t wifi_list_size_in_bytes = 0;
-    bst_wifi_list_entry_t* it = list;
+        // Remove a weaker entry with the same ssid, ignore this one if it is not stronger.
+        size_t i;
+        for (i=0; i < count; ++i)
+            if (strcmp(sorted[i].ssid, list->ssid) == 0)
+                break;
+        if (i < count) {
+            if (sorted[i].strength_percent >= list->strength_percent)
+                continue;
+            memmove(sorted+i, sorted+i+1, (count-i-1)*sizeof(bst_wifi_list_entry_t));
+            --count;
+        }
 
-    // If no error (state == STATE_OK) use the log field for the device name.
-    size_t log_message_len = prv_instance.state.last_error != STATE_OK && prv_instance.state.error_log_msg ?
-                strlen(prv_instance.state.error_log_msg)+1 : strlen(prv_instance.options.name);
+        // Insert after all entries of the same or higher strength
+        size_t pos = count;
+        while (pos > 0 && sorted[pos-1].strength_percent < list->strength_percent)
+            --pos;
+        if (pos == BST_WIFI_LIST_MAX_ENTRIES)
+            continue;
+        if (count == BST_WIFI_LIST_MAX_ENTRIES)
+            --count;
+        memmove(sorted+pos+1, sorted+pos, (count-pos)*sizeof(bst_wifi_list_entry_t));
+        sorted[pos] = *list;
+        ++count;
+    }
 
-    // We always send a fixed size packet to not reveal anything about nearby networks.
-    // The downside: We may not cover all available networks with this packet.
-    bst_udp_send_pkt_t p;
-    memset(&p, 0, sizeof(bst_udp_send_pkt_t));
-    prv_add_header(&p);
-    char* bufferP = p.data_wifi_list_and_log_msg;
-    char* endP = bufferP + sizeof(p.data_wifi_list_and_log_msg);
+    for (size_t i=0; i < count; ++i)
+        sorted[i].next = i+1 < count ? &sorted[i+1] : NULL;
+
+    return count ? sorted : NULL;
+}
+
+/// The log message of wifi list responses, the device name if there is no error.
+static const char* prv_wifi_list_log_message(bst_ctx_t* ctx, size_t* len)
+{
+    if (ctx->state.last_error != STATE_OK && ctx->state.error_log_msg) {
+        *len = strlen(ctx->state.error_log_msg)+1;
+        return ctx->state.error_log_msg;
+    }
+    *len = strlen(ctx->options.name);
+    return ctx->options.name;
+}
+
+/**
+ * @brief Send the wifi list in up to BST_WIFI_LIST_MAX_PAGES packets (protocol version 2+).
+ * Protocol version 3 sends each ssid once, strongest first, in the compact entry format.
+ * Every page contains the log message. All pages but the last have the full size,
+ * page n is encrypted with the keystream bytes following those of page n-1.
+ */
+static void prv_send_paged_wifi_list(bst_ctx_t* ctx, bst_wifi_list_entry_t* list)
+{
+    const bool compact = ctx->state.protocol_version >= 3;
+    if (compact)
+        list = prv_sort_and_dedup_wifi_list(ctx, list, ctx->send.sorted);
+
+    size_t log_message_len;
+    const char* log_message = prv_wifi_list_log_message(ctx, &log_message_len);
+
+    bst_udp_send_paged_pkt_t* p = &ctx->send.p.paged;
+    size_t list_capacity = sizeof(p->data_wifi_list_and_log_msg) - 1;
+    if (log_message_len < list_capacity)
+        list_capacity -= log_message_len;
+    else
+        log_message_len = 0;
+
+    // Count the pages first, the count is part of every page
+    uint8_t page_count = 0;
+    bst_wifi_list_entry_t* it = list;
+    do {
+        uint8_t entries = 0;
+        prv_serialize_wifi_list(ctx, NULL, list_capacity, &it, &entries, compact);
+        // Skip an entry that does not fit into an empty page
+        if (!entries && it)
+            it = it->next;
+        ++page_count;
+    } while (it && page_count < BST_WIFI_LIST_MAX_PAGES);
+
+    prv_send_stream_init(&ctx->send.stream);
 
     it = list;
-    while (it) {
-        size_t ssid_len = strlen(it->ssid);
-        if (bufferP+ssid_len+3>endP)
+    for (uint8_t page = 0; page < page_count; ++page) {
+        memset(p, 0, sizeof(*p));
+        prv_add_header(ctx, (bst_udp_send_hdr_t*)p);
+        p->page = page;
+        p->page_count = page_count;
+
+        uint8_t entries = 0;
+        size_t used = prv_serialize_wifi_list(ctx, p->data_wifi_list_and_log_msg, list_capacity, &it, &entries, compact);
+        if (!entries && it)
+            it = it->next;
+        p->wifi_list_entries = entries;
+        p->wifi_list_size_in_bytes[0] = (used >> 8) & 0xff;
+        p->wifi_list_size_in_bytes[1] = used & 0xff;
+
+        memcpy(p->data_wifi_list_and_log_msg+used, log_message, log_message_len);
+        used += log_message_len + 1;
+
+        size_t pkt_len = sizeof(bst_udp_send_paged_pkt_t);
+        if (page+1 == page_count && ctx->options.wifi_list_size_buckets)
+            pkt_len = prv_wifi_list_bucket_size(offsetof(bst_udp_send_paged_pkt_t, data_wifi_list_and_log_msg)+used);
+
+#if defined(BST_TRACE) && defined(BST_TRACE_IN_WIFI_LIST)
+        // Only in the padding of the last page, it never makes the packet larger
+        if (page+1 == page_count)
+            prv_serialize_trace(ctx, p->data_wifi_list_and_log_msg+used,
+                                pkt_len-offsetof(bst_udp_send_paged_pkt_t, data_wifi_list_and_log_msg)-used);
+#endif
+
+        prv_add_checksum_and_encrypt_stream(ctx, (bst_udp_send_hdr_t*)p, pkt_len, &ctx->send.stream);
+        ctx->callbacks->network_output(ctx->user, (const char*)p, pkt_len);
+    }
+
+    prv_send_stream_wipe(&ctx->send.stream);
+}
+
+#ifdef BST_WIFI_SCAN_CACHE
+/**
+ * @brief Keep a copy of the strongest BST_WIFI_LIST_MAX_ENTRIES different networks
+ * of the list for wifi_scan_cache_ttl_ms, each ssid once with its best strength.
+ */
+static void prv_store_scan_cache(bst_ctx_t* ctx, const bst_wifi_list_entry_t* list)
+{
+    const time_t now = ctx->callbacks->get_system_time_ms(ctx->user);
+    bst_wifi_list_entry_t* it = prv_sort_and_dedup_wifi_list(ctx, list, ctx->scan_cache.entries);
+    bst_wifi_list_entry_t* last = NULL;
+    size_t used = 0;
+
+    // The ssids still point to the memory of the caller, copy them.
+    for (; it; it = it->next) {
+        const size_t ssid_len = strlen(it->ssid)+1;
+        if (used+ssid_len > sizeof(ctx->scan_cache.ssids))
             break;
+        memcpy(ctx->scan_cache.ssids+used, it->ssid, ssid_len);
+        it->ssid = ctx->scan_cache.ssids+used;
+        used += ssid_len;
+        last = it;
+    }
+    if (last)
+        last->next = NULL;
 
-        if (memcmp(it->ssid, prv_instance.options.bootstrap_ssid, ssid_len)==0) {
-            it = it->next;
-            continue;
-        }
+    ctx->scan_cache.list = last ? ctx->scan_cache.entries : NULL;
+    ctx->scan_cache.valid_until = now + ctx->options.wifi_scan_cache_ttl_ms;
+    ctx->scan_cache.next_refresh = now + ctx->options.wifi_scan_cache_ttl_ms/2;
+}
 
-        ++wifi_list_entries;
-        wifi_list_size_in_bytes += ssid_len + 2 + 1; // trailing 0 + wifi strength in percent + enc mode
+static inline bool prv_scan_cache_valid(bst_ctx_t* ctx)
+{
+    return ctx->options.wifi_scan_cache_ttl_ms &&
+            ctx->scan_cache.valid_until > ctx->callbacks->get_system_time_ms(ctx->user);
+}
 
-        // strength +  enc mode
-        bufferP[0] = it->strength_percent;
-        bufferP[1] = it->encryption_mode;
-        bufferP += 2;
+/**
+ * @brief Return false if no background refresh of the scan cache is planned, otherwise
+ * its time in t. The cache is not refreshed during an app session, a running scan
+ * or more than BST_WIFI_SCAN_CACHE_REFRESHES times per wait for data.
+ */
+static bool prv_scan_cache_refresh_time(bst_ctx_t* ctx, time_t* t)
+{
+    if (!ctx->options.wifi_scan_cache_ttl_ms || ctx->flags.wifi_list_response_pending ||
+            ctx->scan_cache.refreshes >= BST_WIFI_SCAN_CACHE_REFRESHES)
+        return false;
+
+    // After the app session, see prv_is_app_session_valid()
+    *t = ctx->scan_cache.next_refresh > ctx->state.time_nonce_valid ?
+                ctx->scan_cache.next_refresh : ctx->state.time_nonce_valid+1;
+    return true;
+}
+#endif
 
-        // ssid
-        memcpy(bufferP, it->ssid, ssid_len);
-        bufferP += ssid_len;
+void bst_ctx_wifi_network_list(bst_ctx_t* ctx, bst_wifi_list_entry_t* list)
+{
+    if (ctx->state.state != BST_MODE_WAITING_FOR_DATA)
+        return;
+
+#ifdef BST_WIFI_SCAN_CACHE
+    if (ctx->options.wifi_scan_cache_ttl_ms) {
+        prv_store_scan_cache(ctx, list);
+        // Only a background refresh
+        if (!ctx->flags.wifi_list_response_pending)
+            return;
+    }
+#endif
+
+    prv_send_wifi_list(ctx, list);
+}
 
-        // trailing 0
-        bufferP[0] = 0;
-        ++bufferP;
+static void prv_send_wifi_list(bst_ctx_t* ctx, bst_wifi_list_entry_t* list)
+{
+    ctx->flags.wifi_list_response_pending = false;
 
-        it = it->next;
+    if (ctx->state.protocol_version >= 2) {
+        prv_send_paged_wifi_list(ctx, list);
+        return;
     }
 
-    if (prv_instance.options.external_confirmation_mode == BST_CONFIRM_NOT_REQUIRED)
-        p.external_confirmation_state = CONFIRM_NOT_REQUIRED;
-    else
-        p.external_confirmation_state =
-                prv_instance.flags.external_confirmation ? CONFIRM_OK : CONFIRM_REQUIRED;
+    // Create buffer that looks like this:
+    // 0: strength of first wifi
+    // 1: encryption mode of first wifi
+    // 2..x: ssid of first wifi with training 0.
+    // x+1: strength of second wifi
+    // ...
+    // log message
 
-    p.wifi_list_entries = wifi_list_entries;
-    p.wifi_list_size_in_bytes = wifi_list_size_in_bytes;
+    // If no error (state == STATE_OK) use the log field for the device name.
+    size_t log_message_len;
+    const char* log_message = prv_wifi_list_log_message(ctx, &log_message_len);
+
+    // We always send a fixed size packet to not reveal anything about nearby networks.
+    // The downside: We may not cover all available networks with this packet.
+    bst_udp_send_pkt_t* p = &ctx->send.p.pkt;
+    memset(p, 0, sizeof(bst_udp_send_pkt_t));
+    prv_add_header(ctx, (bst_udp_send_hdr_t*)p);
+
+    bst_wifi_list_entry_t* it = list;
+    uint8_t wifi_list_entries = 0;
+    size_t used = prv_serialize_wifi_list(ctx, p->data_wifi_list_and_log_msg, sizeof(p->data_wifi_list_and_log_msg),
+                                          &it, &wifi_list_entries, false);
 
-    if (bufferP+log_message_len<endP)
+    p->wifi_list_entries = wifi_list_entries;
+    p->wifi_list_size_in_bytes = (uint8_t)used;
+
+    if (used+log_message_len < sizeof(p->data_wifi_list_and_log_msg))
     {
-        if (prv_instance.state.last_error != STATE_OK && prv_instance.state.error_log_msg) {
-            BST_DBG("log %s\n", prv_instance.state.error_log_msg);
-            memcpy(bufferP, prv_instance.state.error_log_msg, log_message_len);
-        } else {
-            memcpy(bufferP, prv_instance.options.name, log_message_len);
-        }
+        BST_DBG("log %s\n", log_message);
+        memcpy(p->data_wifi_list_and_log_msg+used, log_message, log_message_len);
+        // Including the trailing 0 (the buffer is zeroed)
+        used += log_message_len + 1;
     }
 
-    prv_add_checksum_and_encrypt(&p, sizeof(bst_udp_send_pkt_t));
-    bst_network_output((const char*)&p, sizeof(bst_udp_send_pkt_t));
+    size_t pkt_len = sizeof(bst_udp_send_pkt_t);
+    if (ctx->options.wifi_list_size_buckets)
+        pkt_len = prv_wifi_list_bucket_size(offsetof(bst_udp_send_pkt_t, data_wifi_list_and_log_msg)+used);
+
+#if defined(BST_TRACE) && defined(BST_TRACE_IN_WIFI_LIST)
+    // Only in the padding, it never makes the packet larger
+    prv_serialize_trace(ctx, p->data_wifi_list_and_log_msg+used,
+                        pkt_len-offsetof(bst_udp_send_pkt_t, data_wifi_list_and_log_msg)-used);
+#endif
+
+    prv_add_checksum_and_encrypt(ctx, (bst_udp_send_hdr_t*)p, pkt_len);
+    ctx->callbacks->network_output(ctx->user, (const char*)p, pkt_len);
 }
 
 
-void bst_set_error_message(const char* mesg)
+void bst_ctx_set_error_message(bst_ctx_t* ctx, const char* mesg)
 {
-    prv_instance.state.error_log_msg = mesg;
+    ctx->state.error_log_msg = mesg;
 }
 
-void bst_factory_reset()
+void bst_ctx_factory_reset(bst_ctx_t* ctx)
 {
-    prv_instance.flags.request_factory_reset = true;
+    ctx->flags.request_factory_reset = true;
 }
 
-bst_state bst_get_state()
+bst_state bst_ctx_get_state(bst_ctx_t* ctx)
 {
-    return prv_instance.state.state;
+    return ctx->state.state;
 }
 
-void bst_confirm_bootstrap()
+void bst_ctx_confirm_bootstrap(bst_ctx_t* ctx)
 {
-    prv_instance.flags.external_confirmation = 1;
+    ctx->flags.external_confirmation = 1;
 }
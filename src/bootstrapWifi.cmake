@@ -6,12 +6,24 @@ set(BOOTSTRAP_WIFI_HEADERS
     ${CMAKE_CURRENT_LIST_DIR}/prv_bootstrapWifi.h
     ${CMAKE_CURRENT_LIST_DIR}/bootstrapWifiConfig.h
     ${CMAKE_CURRENT_LIST_DIR}/spritz.h
+    ${CMAKE_CURRENT_LIST_DIR}/crc16.h
+    ${CMAKE_CURRENT_LIST_DIR}/scheduler.h
     )
-set(BOOTSTRAP_WIFI_SOURCES
+# The state machine, the bst_ctx_* functions and the scheduler. Programs that only use
+# the context API link these and do not need the platform functions of bootstrapWifi.h.
+set(BOOTSTRAP_WIFI_CTX_SOURCES
     ${CMAKE_CURRENT_LIST_DIR}/bootstrapWifi.c
-    ${CMAKE_CURRENT_LIST_DIR}/bootstrapWifiDummyImpl.c
     ${CMAKE_CURRENT_LIST_DIR}/spritz.c
+    ${CMAKE_CURRENT_LIST_DIR}/crc16.c
+    ${CMAKE_CURRENT_LIST_DIR}/scheduler.c
     )
 
-set(BOOTSTRAP_WIFI_SOURCES  ${BOOTSTRAP_WIFI_HEADERS} ${BOOTSTRAP_WIFI_SOURCES})
+# The default context of the bst_* functions without a context parameter.
+# It calls the platform functions of bootstrapWifi.h.
+set(BOOTSTRAP_WIFI_DEFAULT_CTX_SOURCES
+    ${CMAKE_CURRENT_LIST_DIR}/bootstrapWifiDefaultCtx.c
+    ${CMAKE_CURRENT_LIST_DIR}/bootstrapWifiDummyImpl.c
+    )
 
+set(BOOTSTRAP_WIFI_SOURCES  ${BOOTSTRAP_WIFI_HEADERS} ${BOOTSTRAP_WIFI_CTX_SOURCES} ${BOOTSTRAP_WIFI_DEFAULT_CTX_SOURCES})
+set(BOOTSTRAP_WIFI_CTX_SOURCES  ${BOOTSTRAP_WIFI_HEADERS} ${BOOTSTRAP_WIFI_CTX_SOURCES})
@@ -43,6 +43,11 @@ typedef enum {
     BST_CONFIRM_ALWAYS_REQUIRED
 } bst_confirmation_mode;
 
+typedef enum {
+    BST_BACKOFF_FIXED,      ///< Retry every reconnect_backoff_base_ms
+    BST_BACKOFF_EXPONENTIAL ///< Multiply the wait time with every retry, up to reconnect_backoff_cap_ms
+} bst_backoff_policy;
+
 typedef struct _bst_connect_options_
 {
     /// Device name.
@@ -101,8 +106,83 @@ typedef struct _bst_connect_options_
     /// for the library to detect if the bootstrapped network reappeared.
     uint8_t retry_connecting_to_bootstrap_network;
     uint8_t retry_connecting_to_destination_network;
+
+    /// The wifi list response is always BST_NETWORK_PACKET_SIZE bytes long, to not
+    /// reveal anything about nearby networks. If this is set to true, the response is
+    /// only padded to the next of the BST_WIFI_LIST_BUCKET_SIZES instead. This saves
+    /// airtime and encryption work, but reveals the rough size of the list.
+    bool wifi_list_size_buckets;
+
+    /// If this is not 0, the last wifi list of bst_wifi_network_list() is cached for
+    /// the given time in ms. Apps are answered from the cache without a new scan.
+    /// While waiting for data without an app session, bst_request_wifi_network_list()
+    /// is called after half of that time to refresh the cache in the background, up to
+    /// BST_WIFI_SCAN_CACHE_REFRESHES times. The cache keeps every ssid once, strongest first.
+    /// Only available if compiled with BST_WIFI_SCAN_CACHE.
+    int wifi_scan_cache_ttl_ms;
+
+    /// If this is set to true, the platform reports every change of the connection state
+    /// with bst_connection_event(). bst_get_connection_state() is then only called once
+    /// in bst_setup() and not polled in bst_periodic() anymore.
+    bool connection_events;
+
+    /// Use one of the bst_backoff_policy values. Reconnection attempts to the bootstrap and
+    /// the destination network wait reconnect_backoff_base_ms (or timeout_connecting_state_ms if 0)
+    /// with BST_BACKOFF_FIXED. With BST_BACKOFF_EXPONENTIAL the n-th retry without a successful
+    /// connection in between waits base*multiplier^n ms, but at most reconnect_backoff_cap_ms
+    /// (BST_BACKOFF_DEFAULT_CAP_MS if 0). The multiplier defaults to 2 if 0.
+    uint8_t reconnect_backoff;
+    uint8_t reconnect_backoff_multiplier;
+    int reconnect_backoff_base_ms;
+    int reconnect_backoff_cap_ms;
+
+    /// Shorten every wait time of a reconnection attempt by a random amount of up to this
+    /// percentage (0-100), with bst_get_random(). Devices that lost their connection at the same
+    /// time, for example because the access point rebooted, do not reconnect in lock-step then.
+    uint8_t reconnect_jitter_percent;
+
+    /// If set, the bootstrap network is not associated blindly. Instead the platform is asked
+    /// to look for it with bst_discover_bootstrap_network() every given ms, for example with a
+    /// directed probe on the channel it was last seen. The library only connects to the
+    /// bootstrap network after bst_bootstrap_network_found() was called. 0 disables discovery.
+    int bootstrap_discovery_interval_ms;
 } bst_connect_options;
 
+/// Counters for bst_network_input(). A packet is rejected in the first stage
+/// that fails, in the order of the members. Only packets that pass all stages
+/// before rejected_crc are decrypted.
+typedef struct _bst_input_stats_
+{
+    uint32_t rejected_ingress;      ///< Shorter or longer than any packet or the ingress ring was full
+    uint32_t rejected_state;        ///< Not waiting for data
+    uint32_t rejected_header;       ///< Header is not BST_NETWORK_HEADER
+    uint32_t rejected_length;       ///< Unknown command or wrong length for the command
+    uint32_t rejected_session;      ///< No app session or a different app nonce
+    uint32_t rejected_pending;      ///< The same command is still processed
+    uint32_t rejected_confirmation; ///< Data without the external confirmation
+    uint32_t rejected_rate;         ///< Too many packets with a wrong crc recently, see BST_INPUT_RATE_BURST
+    uint32_t rejected_crc;          ///< Wrong crc after decryption
+    uint32_t accepted;
+} bst_input_stats;
+
+#ifdef BST_TRACE
+/// Events of the trace ring, see bst_trace_drain().
+typedef enum {
+    BST_TRACE_STATE,            ///< The mode changed. arg: the new bst_state
+    BST_TRACE_CONNECT,          ///< Connection attempt. arg: 0 bootstrap network, 1 destination, 2 destination with hint
+    BST_TRACE_DISCOVER,         ///< bst_discover_bootstrap_network() was called. arg: the channel hint
+    BST_TRACE_PACKET_ACCEPTED,  ///< arg: the command code of the packet
+    BST_TRACE_PACKET_REJECTED   ///< arg: the index of the rejection counter in bst_input_stats
+} bst_trace_event;
+
+/// One record of the trace ring.
+typedef struct bst_trace_record {
+    uint32_t time_ms;   ///< bst_get_system_time_ms() of the event, truncated to 32 bits
+    uint8_t event;      ///< bst_trace_event
+    uint8_t arg;
+} bst_trace_record;
+#endif
+
 typedef struct bst_wifi_list_entry {
     const char* ssid;
     uint8_t strength_percent;
@@ -110,6 +190,43 @@ typedef struct bst_wifi_list_entry {
     struct bst_wifi_list_entry* next;
 } bst_wifi_list_entry_t;
 
+/// Fast reconnect hint: The access point and ip configuration of the last successful
+/// connection to the destination network. Addresses are in network byte order.
+typedef struct bst_connect_hint {
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t ip[4];
+    uint8_t netmask[4];
+    uint8_t gateway[4];
+    uint8_t dns[4];
+} bst_connect_hint;
+
+/// The state of one bootstrap state machine. Every bst_* function without a context
+/// parameter works on a default context and calls the platform functions below.
+/// Use the bst_ctx_* functions to run any number of independent state machines with
+/// their own callbacks, for example in a gateway or a simulator. The library does not
+/// allocate memory: include "prv_bootstrapWifi.h" for sizeof(bst_ctx_t) or use bst_ctx_size().
+typedef struct _instance_ bst_ctx_t;
+
+/// Platform callbacks of a context. They equal the platform functions declared at the end
+/// of this file and get the user pointer of bst_ctx_setup() as first argument.
+typedef struct bst_callbacks {
+    void (*network_output)(void* user, const char* data, size_t data_len);
+    bst_connect_state (*get_connection_state)(void* user);
+    void (*connect_to_wifi)(void* user, const char* ssid, const char* pwd);
+    void (*connect_advanced)(void* user, const char* data);
+    void (*connected_to_bootstrap_network)(void* user);
+    void (*request_wifi_network_list)(void* user);
+    void (*store_bootstrap_data)(void* user, char* bst_data, size_t bst_data_len);
+    void (*store_crypto_secret)(void* user, char* secret, size_t secret_len);
+    time_t (*get_system_time_ms)(void* user);
+    uint64_t (*get_random)(void* user);
+    /// Optional, connect_to_wifi is used if this is NULL.
+    void (*connect_to_wifi_hinted)(void* user, const char* ssid, const char* pwd, const bst_connect_hint* hint);
+    /// Optional, the bootstrap network is assumed to be in range if this is NULL.
+    void (*discover_bootstrap_network)(void* user, const char* ssid, uint8_t channel_hint);
+} bst_callbacks;
+
 /**
  * @brief Boostrap setup routine
  * @param options Configure the boostrap module
@@ -127,23 +244,84 @@ void bst_setup(bst_connect_options options, const char* bst_data, size_t bst_dat
  */
 void bst_periodic();
 
+/**
+ * @brief Return the earliest time (see bst_get_system_time_ms()) at which bst_periodic()
+ * has something to do. Instead of calling bst_periodic() continuously, the host may
+ * sleep until then or until bst_network_input() or bst_connection_event() was called.
+ * The connection state is polled, therefore the returned time is never more than
+ * BST_MAX_SLEEP_MS away (BST_MAX_SLEEP_EVENTS_MS with the connection_events option).
+ * A time in the past is never returned, "now" means bst_periodic() should be called again
+ * immediately.
+ */
+time_t bst_next_wakeup_ms();
+
 /**
  * @brief Forward udp traffic from any udp client of port 8711 to this method.
- * This method will not result in any method callback but will only setup some flags
- * and copy data. The real work will be done in bst_periodic(). This method can be called
- * from another thread.
+ * This method will not result in any method callback but will only copy the packet
+ * into a ring of BST_INGRESS_RING_SLOTS packets. The packets are checked and processed
+ * in bst_periodic(). This method does not block and can be called from another thread
+ * or an interrupt handler, packets are dropped if the ring is full.
  *
- * Not reentrance safe.
+ * Not reentrance safe: Only one thread at a time may call this method.
  *
  * @param data The udp payload
  * @param len The payload length
  */
 void bst_network_input(const char* data, size_t len);
 
+/**
+ * @brief Report a new connection state, for example from the wifi event handler of
+ * the platform. Only used if the connection_events option is set. The state machine
+ * reacts to it in the next bst_periodic() call, bst_next_wakeup_ms() returns "now"
+ * until then. A BST_STATE_FAILED_* state is not overwritten by BST_STATE_NO_CONNECTION
+ * before bst_periodic() has seen it.
+ *
+ * This method does not block and can be called from another thread or an interrupt handler.
+ * Not reentrance safe: Only one thread at a time may call this method.
+ * @param state The new connection state, as bst_get_connection_state() would return it.
+ */
+void bst_connection_event(bst_connect_state state);
+
+/**
+ * @brief Report that the bootstrap network is in range, as a response to
+ * bst_discover_bootstrap_network(). The library connects to it in the next bst_periodic()
+ * call, bst_next_wakeup_ms() returns "now" until then. Only used if the
+ * bootstrap_discovery_interval_ms option is set.
+ *
+ * This method does not block and can be called from another thread or an interrupt handler.
+ * @param channel The channel the network was seen on or 0 if unknown. It is given as hint
+ * to the next bst_discover_bootstrap_network() call.
+ */
+void bst_bootstrap_network_found(uint8_t channel);
+
+/**
+ * @brief Report that the bootstrap network was not found or that looking for it failed,
+ * as a response to bst_discover_bootstrap_network(). The channel hint is dropped, the
+ * next bst_discover_bootstrap_network() call after bootstrap_discovery_interval_ms
+ * looks on all channels. Only used if the bootstrap_discovery_interval_ms option is set.
+ *
+ * This method does not block and can be called from another thread or an interrupt handler.
+ */
+void bst_bootstrap_network_not_found();
+
+/**
+ * @brief Report the access point and ip configuration after a connection to the destination
+ * network has been established (for example after the dhcp lease). It is appended to the
+ * bootstrap data and bst_store_bootstrap_data() is called if it changed. The next connection
+ * attempts to the destination network use bst_connect_to_wifi_hinted() with this hint.
+ * Ignored if the device is not connecting or connected to the destination network.
+ *
+ * Call this from the same thread as bst_periodic().
+ * @param hint The hint. Copied, it can be freed after the method returns.
+ */
+void bst_set_connect_hint(const bst_connect_hint* hint);
+
 /**
  * @brief Call this with neighbour wireless networks as a response for a bst_request_wifi_network_list() call.
  *
  * You should only call this as a response due to a former request from bst_request_wifi_network_list().
+ * If the wifi_scan_cache_ttl_ms option is set, the list is only sent if an app is waiting for it,
+ * otherwise it only refreshes the cache.
  * Will send a list of wifis in range to udp port 8711 via bst_network_output().
  * @param list The list of networks. This can be freed after the method returns. This can be NULL.
  */
@@ -167,6 +345,64 @@ bst_state bst_get_state();
  */
 void bst_confirm_bootstrap();
 
+/**
+ * @return Counters of accepted and rejected packets since bst_setup().
+ */
+const bst_input_stats* bst_get_input_stats();
+
+#ifdef BST_TRACE
+/**
+ * @brief Copy the oldest trace records into "out" and remove them from the trace ring.
+ * The ring keeps the last BST_TRACE_SLOTS state changes, connection attempts and accepted or
+ * rejected packets (not counting the packets that bst_network_input() drops). It is only
+ * available if the library is compiled with BST_TRACE and is cleared by bst_setup().
+ * Call this from the same thread as bst_periodic().
+ * @param out Memory for up to "max" records.
+ * @return The number of copied records.
+ */
+size_t bst_trace_drain(bst_trace_record* out, size_t max);
+
+/// Like bst_trace_drain(), but the records stay in the trace ring.
+size_t bst_trace_snapshot(bst_trace_record* out, size_t max);
+#endif
+
+///////////////////////////////////////////////////////////////////
+/////////////////////////// Context API ///////////////////////////
+
+/// @return sizeof(bst_ctx_t) in bytes.
+size_t bst_ctx_size();
+
+/**
+ * @brief Setup a context, like bst_setup() for the default context.
+ * @param ctx Caller provided memory of bst_ctx_size() bytes. It has to stay valid as long as the
+ * context is used.
+ * @param callbacks The platform callbacks. Not copied, the table can be shared by many contexts.
+ * @param user Passed to every callback.
+ */
+void bst_ctx_setup(bst_ctx_t* ctx, const bst_callbacks* callbacks, void* user,
+                   bst_connect_options options, const char* bst_data, size_t bst_data_len,
+                   const char* secret_key, size_t secret_key_len);
+
+/// The following functions equal the bst_* functions of the same name, for the given context.
+/// Contexts are independent, different contexts may be used from different threads.
+void bst_ctx_periodic(bst_ctx_t* ctx);
+time_t bst_ctx_next_wakeup_ms(bst_ctx_t* ctx);
+void bst_ctx_network_input(bst_ctx_t* ctx, const char* data, size_t len);
+void bst_ctx_connection_event(bst_ctx_t* ctx, bst_connect_state state);
+void bst_ctx_set_connect_hint(bst_ctx_t* ctx, const bst_connect_hint* hint);
+void bst_ctx_bootstrap_network_found(bst_ctx_t* ctx, uint8_t channel);
+void bst_ctx_bootstrap_network_not_found(bst_ctx_t* ctx);
+void bst_ctx_wifi_network_list(bst_ctx_t* ctx, bst_wifi_list_entry_t* list);
+void bst_ctx_factory_reset(bst_ctx_t* ctx);
+bst_state bst_ctx_get_state(bst_ctx_t* ctx);
+void bst_ctx_confirm_bootstrap(bst_ctx_t* ctx);
+void bst_ctx_set_error_message(bst_ctx_t* ctx, const char* mesg);
+const bst_input_stats* bst_ctx_get_input_stats(bst_ctx_t* ctx);
+#ifdef BST_TRACE
+size_t bst_ctx_trace_drain(bst_ctx_t* ctx, bst_trace_record* out, size_t max);
+size_t bst_ctx_trace_snapshot(bst_ctx_t* ctx, bst_trace_record* out, size_t max);
+#endif
+
 ///////////////////////////////////////////////////////////////////
 ///////////////// Implement the following methods /////////////////
 
@@ -194,6 +430,34 @@ bst_connect_state bst_get_connection_state();
  */
 void bst_connect_to_wifi(const char* ssid, const char* pwd);
 
+/**
+ * @brief bst_connect_to_wifi_hinted
+ * Connect to the destination network with the hint of bst_set_connect_hint(): Connect to the
+ * given bssid on the given channel and use the ip configuration instead of dhcp, to skip the
+ * scan of all channels and the dhcp handshake. If the attempt fails, report a failure state
+ * or let it time out: The next attempt is done with bst_connect_to_wifi() again and a full scan.
+ *
+ * Optional: The default implementation ignores the hint and calls bst_connect_to_wifi().
+ * @param ssid
+ * @param pwd
+ * @param hint The access point and ip configuration of the last successful connection.
+ */
+void bst_connect_to_wifi_hinted(const char* ssid, const char* pwd, const bst_connect_hint* hint);
+
+/**
+ * @brief bst_discover_bootstrap_network
+ * Only used if the bootstrap_discovery_interval_ms option is set. Look for the bootstrap
+ * network without connecting to it, for example with a directed probe request or a scan of
+ * a single channel, and call bst_bootstrap_network_found() if it is in range.
+ * Call bst_bootstrap_network_not_found() otherwise, the library asks again after
+ * bootstrap_discovery_interval_ms. Do not look again on your own.
+ *
+ * Optional: The default implementation reports the network as found immediately.
+ * @param ssid The bootstrap ssid.
+ * @param channel_hint The channel the network was last seen on or 0 if unknown. Try it first.
+ */
+void bst_discover_bootstrap_network(const char* ssid, uint8_t channel_hint);
+
 /// If you need to bootstrap not only the wifi connection but for example also
 /// need to connect to a server, you may set the **need_advanced_connection** option.
 /// After a successful wifi connection this method will be called with the additional data the app provided.
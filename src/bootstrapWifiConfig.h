@@ -24,10 +24,10 @@
 #define BST_AUTH_SIZE 32
 #endif
 
-// We always send fixed size packets.
-// If this value is too small, we cannot send
-// all neighbour wireless ssids to a connected
-// app.
+// Size of a wifi list packet (or page, protocol version 2+). Responses are
+// padded to this size, or to one of the BST_WIFI_LIST_BUCKET_SIZES if the
+// wifi_list_size_buckets option is set. If this value is too small, the
+// wifi list needs more pages or is cut off.
 #ifndef BST_NETWORK_PACKET_SIZE
 #define BST_NETWORK_PACKET_SIZE 512
 #endif
@@ -36,8 +36,139 @@
 #define BST_NETWORK_HEADER "BSTwifi1"
 #endif
 
+// The last character of the header is the protocol version. The app selects the version
+// with the header of its HELLO packet, the device answers with the same version.
+// 1: One wifi list packet
+// 2: Wifi list split into pages (bst_udp_send_paged_pkt_t)
+// 3: Like 2, but every ssid once with its highest strength, strongest first,
+//    strength and encryption mode packed into one byte.
+#ifndef BST_PROTOCOL_VERSION
+#define BST_PROTOCOL_VERSION 3
+#endif
+
+// Maximum number of pages of a wifi list response (protocol version 2+).
+#ifndef BST_WIFI_LIST_MAX_PAGES
+#define BST_WIFI_LIST_MAX_PAGES 4
+#endif
+
+// Maximum number of different ssids of a wifi list response (protocol version 3).
+// The sorted copy of that many bst_wifi_list_entry_t is kept in the context (send.sorted).
+#ifndef BST_WIFI_LIST_MAX_ENTRIES
+#define BST_WIFI_LIST_MAX_ENTRIES 32
+#endif
+
+// CRC16 implementation. Choose between code size and speed:
+// BST_CRC16_BITWISE:       No table, 8 shifts per byte
+// BST_CRC16_NIBBLE_TABLE:  32 Bytes table
+// BST_CRC16_BYTE_TABLE:    512 Bytes table
+// BST_CRC16_SLICING_BY_4:  2 KBytes of tables, 4 bytes per step
+// BST_CRC16_SLICING_BY_8:  4 KBytes of tables, 8 bytes per step
+// The default is slicing-by-8 for 64 bit host builds and the nibble table otherwise.
+// Long buffers are folded with carry-less multiplication on x86-64 (if the cpu
+// supports PCLMULQDQ) and aarch64 with the crypto extension. Define
+// BST_CRC16_NO_CLMUL to always use the selected variant.
+#define BST_CRC16_BITWISE 0
+#define BST_CRC16_NIBBLE_TABLE 1
+#define BST_CRC16_BYTE_TABLE 2
+#define BST_CRC16_SLICING_BY_4 3
+#define BST_CRC16_SLICING_BY_8 4
+
+#ifndef BST_CRC16_VARIANT
+#if defined(__x86_64__) || defined(__aarch64__) || defined(_M_X64)
+#define BST_CRC16_VARIANT BST_CRC16_SLICING_BY_8
+#else
+#define BST_CRC16_VARIANT BST_CRC16_NIBBLE_TABLE
+#endif
+#endif
+
+// Incoming packets that need a crc check or decryption are rate limited by a
+// token bucket: BST_INPUT_RATE_BURST packets at once, after that one packet
+// every BST_INPUT_RATE_REFILL_MS ms. Packets beyond that are dropped before
+// decryption. Authenticated packets return their token, so only failed checks
+// use up the bucket.
+#ifndef BST_INPUT_RATE_BURST
+#define BST_INPUT_RATE_BURST 8
+#endif
+
+#ifndef BST_INPUT_RATE_REFILL_MS
+#define BST_INPUT_RATE_REFILL_MS 125
+#endif
+
+// Packet sizes for the wifi list, if the wifi_list_size_buckets option is set.
+// The response is padded to the smallest bucket that fits the wifi list and log
+// message, or to BST_NETWORK_PACKET_SIZE. Ascending order.
+#ifndef BST_WIFI_LIST_BUCKET_SIZES
+#define BST_WIFI_LIST_BUCKET_SIZES 128, 256
+#endif
+
+// BST_WIFI_SCAN_CACHE
+// Define BST_WIFI_SCAN_CACHE to compile in the scan cache of the wifi_scan_cache_ttl_ms
+// option, the option has no effect otherwise. BST_WIFI_SCAN_CACHE_SIZE is the memory
+// for the ssids. The cache keeps the strongest BST_WIFI_LIST_MAX_ENTRIES ssids of a scan,
+// each once, as long as they fit. An app waiting for a scan gets the complete result. Without an app session, the cache is refreshed in the
+// background at most BST_WIFI_SCAN_CACHE_REFRESHES times per wait for data.
+#ifndef BST_WIFI_SCAN_CACHE_SIZE
+#define BST_WIFI_SCAN_CACHE_SIZE 384
+#endif
+
+#ifndef BST_WIFI_SCAN_CACHE_REFRESHES
+#define BST_WIFI_SCAN_CACHE_REFRESHES 2
+#endif
+
+// Longest time bst_next_wakeup_ms() lets the host sleep. Changes of
+// bst_get_connection_state() are noticed with this delay at the latest.
+#ifndef BST_MAX_SLEEP_MS
+#define BST_MAX_SLEEP_MS 500
+#endif
+
+// Longest time bst_next_wakeup_ms() lets the host sleep if the connection state is
+// reported with bst_connection_event() (option connection_events) instead of polled.
+#ifndef BST_MAX_SLEEP_EVENTS_MS
+#define BST_MAX_SLEEP_EVENTS_MS 60000
+#endif
+
+// Longest wait time of the exponential reconnect backoff, if the
+// reconnect_backoff_cap_ms option is 0.
+#ifndef BST_BACKOFF_DEFAULT_CAP_MS
+#define BST_BACKOFF_DEFAULT_CAP_MS 300000
+#endif
+
+// Resolution and size of the timer wheel of bst_scheduler (scheduler.h). Deadlines
+// are rounded up to BST_SCHEDULER_TICK_MS. A slot holds the deadlines of every
+// BST_SCHEDULER_SLOTS-th tick, it should cover the usual timeouts. Has to be a power of two.
+#ifndef BST_SCHEDULER_TICK_MS
+#define BST_SCHEDULER_TICK_MS 10
+#endif
+#ifndef BST_SCHEDULER_SLOTS
+#define BST_SCHEDULER_SLOTS 1024
+#endif
+
+// Records of the trace ring, if compiled with BST_TRACE. Each record takes 8 bytes.
+// Has to be a power of two. Define BST_TRACE_IN_WIFI_LIST to append the newest records
+// to wifi list responses, after the log message.
+#ifndef BST_TRACE_SLOTS
+#define BST_TRACE_SLOTS 32
+#endif
+
+// Received packets are copied into a ring and processed in bst_periodic().
+// Each slot takes the size of the largest packet (about BST_STORAGE_RAM_SIZE bytes).
+// Has to be a power of two.
+#ifndef BST_INGRESS_RING_SLOTS
+#define BST_INGRESS_RING_SLOTS 2
+#endif
+
 // BST_NO_ERROR_MESSAGES
 // Define BST_NO_ERROR_MESSAGES if you do not want
 // to have english error messages for common errors
 // like BST_STATE_FAILED_SSID_NOT_FOUND. Error messages
 // appear in the app for a device as detailed status message.
+
+// BST_PRECOMPUTE_KEYSTREAM
+// Define BST_PRECOMPUTE_KEYSTREAM to generate the keystream for the next outgoing
+// (wifi list) packet in otherwise idle bst_periodic() calls, as soon as the app nonce
+// is known. The response itself is then only a cheap add pass. This costs about
+// BST_NETWORK_PACKET_SIZE+sizeof(spritz_state) bytes of RAM.
+// BST_PRECOMPUTE_KEYSTREAM_CHUNK bytes are generated per bst_periodic() call.
+#ifndef BST_PRECOMPUTE_KEYSTREAM_CHUNK
+#define BST_PRECOMPUTE_KEYSTREAM_CHUNK 64
+#endif
@@ -0,0 +1,192 @@
+#include "bootstrapWifi.h"
+#include "prv_bootstrapWifi.h"
+
+// The default context of the bst_* functions. It forwards the callbacks to
+// the platform functions declared in bootstrapWifi.h. This is the only file
+// that references them, a user of the context API only does not need to
+// implement them.
+
+instance_t prv_instance;
+
+static void prv_network_output(void* user, const char* data, size_t data_len)
+{
+    (void)user;
+    bst_network_output(data, data_len);
+}
+
+static bst_connect_state prv_get_connection_state(void* user)
+{
+    (void)user;
+    return bst_get_connection_state();
+}
+
+static void prv_connect_to_wifi(void* user, const char* ssid, const char* pwd)
+{
+    (void)user;
+    bst_connect_to_wifi(ssid, pwd);
+}
+
+static void prv_connect_to_wifi_hinted(void* user, const char* ssid, const char* pwd, const bst_connect_hint* hint)
+{
+    (void)user;
+    bst_connect_to_wifi_hinted(ssid, pwd, hint);
+}
+
+static void prv_discover_bootstrap_network(void* user, const char* ssid, uint8_t channel_hint)
+{
+    (void)user;
+    bst_discover_bootstrap_network(ssid, channel_hint);
+}
+
+static void prv_connect_advanced(void* user, const char* data)
+{
+    (void)user;
+    bst_connect_advanced(data);
+}
+
+static void prv_connected_to_bootstrap_network(void* user)
+{
+    (void)user;
+    bst_connected_to_bootstrap_network();
+}
+
+static void prv_request_wifi_network_list(void* user)
+{
+    (void)user;
+    bst_request_wifi_network_list();
+}
+
+static void prv_store_bootstrap_data(void* user, char* bst_data, size_t bst_data_len)
+{
+    (void)user;
+    bst_store_bootstrap_data(bst_data, bst_data_len);
+}
+
+static void prv_store_crypto_secret(void* user, char* secret, size_t secret_len)
+{
+    (void)user;
+    bst_store_crypto_secret(secret, secret_len);
+}
+
+static time_t prv_get_system_time_ms(void* user)
+{
+    (void)user;
+    return bst_get_system_time_ms();
+}
+
+static uint64_t prv_get_random(void* user)
+{
+    (void)user;
+    return bst_get_random();
+}
+
+static const bst_callbacks prv_platform_callbacks = {
+    prv_network_output,
+    prv_get_connection_state,
+    prv_connect_to_wifi,
+    prv_connect_advanced,
+    prv_connected_to_bootstrap_network,
+    prv_request_wifi_network_list,
+    prv_store_bootstrap_data,
+    prv_store_crypto_secret,
+    prv_get_system_time_ms,
+    prv_get_random,
+    prv_connect_to_wifi_hinted,
+    prv_discover_bootstrap_network
+};
+
+// The hint is optional for a platform, connect with a full scan by default.
+void __attribute__((weak)) bst_connect_to_wifi_hinted(const char* ssid, const char* pwd, const bst_connect_hint* hint)
+{
+    (void)hint;
+    bst_connect_to_wifi(ssid, pwd);
+}
+
+// Without a way to look for the bootstrap network, assume it is in range.
+void __attribute__((weak)) bst_discover_bootstrap_network(const char* ssid, uint8_t channel_hint)
+{
+    (void)ssid;
+    bst_bootstrap_network_found(channel_hint);
+}
+
+void bst_setup(bst_connect_options options, const char* bst_data, size_t bst_data_len, const char *bound_key, size_t bound_key_len)
+{
+    bst_ctx_setup(&prv_instance, &prv_platform_callbacks, NULL, options, bst_data, bst_data_len, bound_key, bound_key_len);
+}
+
+void bst_periodic()
+{
+    bst_ctx_periodic(&prv_instance);
+}
+
+time_t bst_next_wakeup_ms()
+{
+    return bst_ctx_next_wakeup_ms(&prv_instance);
+}
+
+void bst_network_input(const char* data, size_t len)
+{
+    bst_ctx_network_input(&prv_instance, data, len);
+}
+
+void bst_connection_event(bst_connect_state state)
+{
+    bst_ctx_connection_event(&prv_instance, state);
+}
+
+void bst_bootstrap_network_found(uint8_t channel)
+{
+    bst_ctx_bootstrap_network_found(&prv_instance, channel);
+}
+
+void bst_bootstrap_network_not_found()
+{
+    bst_ctx_bootstrap_network_not_found(&prv_instance);
+}
+
+void bst_set_connect_hint(const bst_connect_hint* hint)
+{
+    bst_ctx_set_connect_hint(&prv_instance, hint);
+}
+
+void bst_wifi_network_list(bst_wifi_list_entry_t* list)
+{
+    bst_ctx_wifi_network_list(&prv_instance, list);
+}
+
+void bst_factory_reset()
+{
+    bst_ctx_factory_reset(&prv_instance);
+}
+
+bst_state bst_get_state()
+{
+    return bst_ctx_get_state(&prv_instance);
+}
+
+void bst_confirm_bootstrap()
+{
+    bst_ctx_confirm_bootstrap(&prv_instance);
+}
+
+void bst_set_error_message(const char* mesg)
+{
+    bst_ctx_set_error_message(&prv_instance, mesg);
+}
+
+const bst_input_stats* bst_get_input_stats()
+{
+    return bst_ctx_get_input_stats(&prv_instance);
+}
+
+#ifdef BST_TRACE
+size_t bst_trace_drain(bst_trace_record* out, size_t max)
+{
+    return bst_ctx_trace_drain(&prv_instance, out, max);
+}
+
+size_t bst_trace_snapshot(bst_trace_record* out, size_t max)
+{
+    return bst_ctx_trace_snapshot(&prv_instance, out, max);
+}
+#endif
@@ -0,0 +1,270 @@
+#include "crc16.h"
+
+#include <stdbool.h>
+
+// The tables are generated by the compiler, there are no hand pasted values.
+// CRC16_STEP shifts the crc register by one bit (with a zero input bit).
+#define CRC16_STEP(c)  ((((c) << 1) ^ (((c) & 0x8000) ? BST_CRC16_POLY : 0)) & 0xffff)
+#define CRC16_STEP4(c) CRC16_STEP(CRC16_STEP(CRC16_STEP(CRC16_STEP(c))))
+#define CRC16_STEP8(c) CRC16_STEP4(CRC16_STEP4(c))
+
+#if BST_CRC16_VARIANT == BST_CRC16_NIBBLE_TABLE
+
+#define CRC16_NIBBLE(n) CRC16_STEP4((n) << 12)
+
+const uint16_t bst_crc16_nibble_table[16] = {
+    CRC16_NIBBLE(0x0), CRC16_NIBBLE(0x1), CRC16_NIBBLE(0x2), CRC16_NIBBLE(0x3),
+    CRC16_NIBBLE(0x4), CRC16_NIBBLE(0x5), CRC16_NIBBLE(0x6), CRC16_NIBBLE(0x7),
+    CRC16_NIBBLE(0x8), CRC16_NIBBLE(0x9), CRC16_NIBBLE(0xa), CRC16_NIBBLE(0xb),
+    CRC16_NIBBLE(0xc), CRC16_NIBBLE(0xd), CRC16_NIBBLE(0xe), CRC16_NIBBLE(0xf)
+};
+
+#elif BST_CRC16_VARIANT >= BST_CRC16_BYTE_TABLE
+
+// Table k contains the crc of every byte value followed by k zero bytes.
+// The crc without init value is linear, so every entry is the XOR of the
+// entries for the single bits of its index. Those are computed first, as enum
+// constants row by row: a row is the former row shifted by another zero byte.
+#define CRC16_ROW(k, b0, b1, b2, b3, b4, b5, b6, b7) \
+    CRC16_B##k##_0 = CRC16_STEP8(b0), CRC16_B##k##_1 = CRC16_STEP8(b1), \
+    CRC16_B##k##_2 = CRC16_STEP8(b2), CRC16_B##k##_3 = CRC16_STEP8(b3), \
+    CRC16_B##k##_4 = CRC16_STEP8(b4), CRC16_B##k##_5 = CRC16_STEP8(b5), \
+    CRC16_B##k##_6 = CRC16_STEP8(b6), CRC16_B##k##_7 = CRC16_STEP8(b7)
+#define CRC16_NEXT_ROW(k, p) CRC16_ROW(k, CRC16_B##p##_0, CRC16_B##p##_1, CRC16_B##p##_2, CRC16_B##p##_3, \
+                                          CRC16_B##p##_4, CRC16_B##p##_5, CRC16_B##p##_6, CRC16_B##p##_7)
+
+enum {
+    CRC16_ROW(0, 0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, 0x8000),
+    CRC16_NEXT_ROW(1, 0), CRC16_NEXT_ROW(2, 1), CRC16_NEXT_ROW(3, 2),
+    CRC16_NEXT_ROW(4, 3), CRC16_NEXT_ROW(5, 4), CRC16_NEXT_ROW(6, 5), CRC16_NEXT_ROW(7, 6)
+};
+
+#define CRC16_ENTRY(k, i) ( \
+    (((i) & 0x01) ? CRC16_B##k##_0 : 0) ^ (((i) & 0x02) ? CRC16_B##k##_1 : 0) ^ \
+    (((i) & 0x04) ? CRC16_B##k##_2 : 0) ^ (((i) & 0x08) ? CRC16_B##k##_3 : 0) ^ \
+    (((i) & 0x10) ? CRC16_B##k##_4 : 0) ^ (((i) & 0x20) ? CRC16_B##k##_5 : 0) ^ \
+    (((i) & 0x40) ? CRC16_B##k##_6 : 0) ^ (((i) & 0x80) ? CRC16_B##k##_7 : 0))
+#define CRC16_ENTRIES4(k, i)   CRC16_ENTRY(k, i), CRC16_ENTRY(k, i+1), CRC16_ENTRY(k, i+2), CRC16_ENTRY(k, i+3)
+#define CRC16_ENTRIES16(k, i)  CRC16_ENTRIES4(k, i), CRC16_ENTRIES4(k, i+4), CRC16_ENTRIES4(k, i+8), CRC16_ENTRIES4(k, i+12)
+#define CRC16_ENTRIES64(k, i)  CRC16_ENTRIES16(k, i), CRC16_ENTRIES16(k, i+16), CRC16_ENTRIES16(k, i+32), CRC16_ENTRIES16(k, i+48)
+#define CRC16_TABLE(k)         { CRC16_ENTRIES64(k, 0), CRC16_ENTRIES64(k, 64), CRC16_ENTRIES64(k, 128), CRC16_ENTRIES64(k, 192) }
+
+#if BST_CRC16_VARIANT == BST_CRC16_BYTE_TABLE
+const uint16_t bst_crc16_tables[1][256] = {
+    CRC16_TABLE(0)
+};
+#elif BST_CRC16_VARIANT == BST_CRC16_SLICING_BY_4
+const uint16_t bst_crc16_tables[4][256] = {
+    CRC16_TABLE(0), CRC16_TABLE(1), CRC16_TABLE(2), CRC16_TABLE(3)
+};
+#else
+const uint16_t bst_crc16_tables[8][256] = {
+    CRC16_TABLE(0), CRC16_TABLE(1), CRC16_TABLE(2), CRC16_TABLE(3),
+    CRC16_TABLE(4), CRC16_TABLE(5), CRC16_TABLE(6), CRC16_TABLE(7)
+};
+#endif
+
+#endif
+
+static uint16_t prv_crc16_update_portable(uint16_t crc, const unsigned char *data, size_t len)
+{
+#if BST_CRC16_VARIANT == BST_CRC16_SLICING_BY_4
+    // The current crc is XORed into the first two bytes, every byte is then
+    // looked up in the table for the number of bytes that follow it in the block.
+    while (len >= 4) {
+        crc = bst_crc16_tables[3][(crc >> 8) ^ data[0]] ^
+              bst_crc16_tables[2][(crc & 0xff) ^ data[1]] ^
+              bst_crc16_tables[1][data[2]] ^
+              bst_crc16_tables[0][data[3]];
+        data += 4;
+        len -= 4;
+    }
+#elif BST_CRC16_VARIANT == BST_CRC16_SLICING_BY_8
+    while (len >= 8) {
+        crc = bst_crc16_tables[7][(crc >> 8) ^ data[0]] ^
+              bst_crc16_tables[6][(crc & 0xff) ^ data[1]] ^
+              bst_crc16_tables[5][data[2]] ^
+              bst_crc16_tables[4][data[3]] ^
+              bst_crc16_tables[3][data[4]] ^
+              bst_crc16_tables[2][data[5]] ^
+              bst_crc16_tables[1][data[6]] ^
+              bst_crc16_tables[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+#endif
+
+    while (len) {
+        crc = crc16_ccitt_byte(crc, *data++);
+        --len;
+    }
+
+    return crc;
+}
+
+// BST_CRC16_CLMUL: Fold 16 byte blocks with a carry-less multiplication
+// (PCLMULQDQ on x86-64, PMULL on aarch64) and only reduce the last block
+// with the portable implementation. Enabled by default for x86-64 host builds
+// (the cpu is probed at runtime) and for aarch64 builds with the crypto extension.
+// Define BST_CRC16_NO_CLMUL to disable it.
+#if !defined(BST_CRC16_CLMUL) && !defined(BST_CRC16_NO_CLMUL)
+# if defined(__x86_64__) && defined(__GNUC__)
+#  define BST_CRC16_CLMUL
+# elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#  define BST_CRC16_CLMUL
+# endif
+#endif
+
+#ifdef BST_CRC16_CLMUL
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+# define CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#else
+# include <arm_neon.h>
+# define CLMUL_TARGET
+#endif
+
+// Shorter buffers are faster with the tables.
+#define CLMUL_MIN_LEN 64
+
+// x^n mod P for the fold distances of 128 and 512 bits. A 128 bit block A at
+// distance D in front of the rest is replaced by
+// A.hi*(x^(D+64) mod P) + A.lo*(x^D mod P), which has less than 80 bits.
+// The powers are enum constants, each one is the former shifted by a zero byte.
+#define CRC16_XPOW(n, p) CRC16_X##n = CRC16_STEP8(CRC16_X##p)
+
+enum {
+    CRC16_X8 = 0x0100,
+    CRC16_XPOW(16, 8), CRC16_XPOW(24, 16), CRC16_XPOW(32, 24), CRC16_XPOW(40, 32), CRC16_XPOW(48, 40), CRC16_XPOW(56, 48),
+    CRC16_XPOW(64, 56), CRC16_XPOW(72, 64), CRC16_XPOW(80, 72), CRC16_XPOW(88, 80), CRC16_XPOW(96, 88), CRC16_XPOW(104, 96),
+    CRC16_XPOW(112, 104), CRC16_XPOW(120, 112), CRC16_XPOW(128, 120), CRC16_XPOW(136, 128), CRC16_XPOW(144, 136), CRC16_XPOW(152, 144),
+    CRC16_XPOW(160, 152), CRC16_XPOW(168, 160), CRC16_XPOW(176, 168), CRC16_XPOW(184, 176), CRC16_XPOW(192, 184), CRC16_XPOW(200, 192),
+    CRC16_XPOW(208, 200), CRC16_XPOW(216, 208), CRC16_XPOW(224, 216), CRC16_XPOW(232, 224), CRC16_XPOW(240, 232), CRC16_XPOW(248, 240),
+    CRC16_XPOW(256, 248), CRC16_XPOW(264, 256), CRC16_XPOW(272, 264), CRC16_XPOW(280, 272), CRC16_XPOW(288, 280), CRC16_XPOW(296, 288),
+    CRC16_XPOW(304, 296), CRC16_XPOW(312, 304), CRC16_XPOW(320, 312), CRC16_XPOW(328, 320), CRC16_XPOW(336, 328), CRC16_XPOW(344, 336),
+    CRC16_XPOW(352, 344), CRC16_XPOW(360, 352), CRC16_XPOW(368, 360), CRC16_XPOW(376, 368), CRC16_XPOW(384, 376), CRC16_XPOW(392, 384),
+    CRC16_XPOW(400, 392), CRC16_XPOW(408, 400), CRC16_XPOW(416, 408), CRC16_XPOW(424, 416), CRC16_XPOW(432, 424), CRC16_XPOW(440, 432),
+    CRC16_XPOW(448, 440), CRC16_XPOW(456, 448), CRC16_XPOW(464, 456), CRC16_XPOW(472, 464), CRC16_XPOW(480, 472), CRC16_XPOW(488, 480),
+    CRC16_XPOW(496, 488), CRC16_XPOW(504, 496), CRC16_XPOW(512, 504), CRC16_XPOW(520, 512), CRC16_XPOW(528, 520), CRC16_XPOW(536, 528),
+    CRC16_XPOW(544, 536), CRC16_XPOW(552, 544), CRC16_XPOW(560, 552), CRC16_XPOW(568, 560), CRC16_XPOW(576, 568)
+};
+
+static const struct {
+    uint64_t k128, k192, k512, k576;
+} prv_keys = { CRC16_X128, CRC16_X192, CRC16_X512, CRC16_X576 };
+
+// 0: not probed yet, 1: available, -1: not available
+static int prv_clmul_state;
+
+static bool prv_clmul_available(void)
+{
+    int state = __atomic_load_n(&prv_clmul_state, __ATOMIC_ACQUIRE);
+    if (state == 0) {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        state = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3") ? 1 : -1;
+#else
+        state = 1;
+#endif
+        __atomic_store_n(&prv_clmul_state, state, __ATOMIC_RELEASE);
+    }
+    return state > 0;
+}
+
+// The blocks are kept as 128 bit big endian numbers: bit 127 is the msb of
+// the first byte, so the polynomial degrees are in register order.
+#if defined(__x86_64__)
+typedef __m128i clmul_vec;
+# define CLMUL_BSWAP  const __m128i bswap = _mm_setr_epi8(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0)
+# define CLMUL_KEYS(hi, lo) _mm_set_epi64x((long long)(hi), (long long)(lo))
+# define CLMUL_LOAD(p) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p)), bswap)
+# define CLMUL_STORE(p, v) _mm_storeu_si128((__m128i*)(p), _mm_shuffle_epi8(v, bswap))
+# define CLMUL_XOR(a, b) _mm_xor_si128(a, b)
+# define CLMUL_FOLD(v, k) _mm_xor_si128(_mm_clmulepi64_si128(v, k, 0x11), _mm_clmulepi64_si128(v, k, 0x00))
+# define CLMUL_CRC(crc) _mm_slli_si128(_mm_cvtsi32_si128(crc), 14)
+#else
+typedef uint64x2_t clmul_vec;
+# define CLMUL_BSWAP
+# define CLMUL_KEYS(hi, lo) vcombine_u64(vcreate_u64(lo), vcreate_u64(hi))
+static inline uint64x2_t prv_clmul_load(const unsigned char *p)
+{
+    uint8x16_t v = vrev64q_u8(vld1q_u8(p));
+    return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+static inline void prv_clmul_store(unsigned char *p, uint64x2_t x)
+{
+    uint8x16_t v = vreinterpretq_u8_u64(x);
+    vst1q_u8(p, vrev64q_u8(vextq_u8(v, v, 8)));
+}
+static inline uint64x2_t prv_clmul_fold(uint64x2_t v, uint64x2_t k)
+{
+    poly128_t h = vmull_p64((poly64_t)vgetq_lane_u64(v, 1), (poly64_t)vgetq_lane_u64(k, 1));
+    poly128_t l = vmull_p64((poly64_t)vgetq_lane_u64(v, 0), (poly64_t)vgetq_lane_u64(k, 0));
+    return veorq_u64(vreinterpretq_u64_p128(h), vreinterpretq_u64_p128(l));
+}
+# define CLMUL_LOAD(p) prv_clmul_load(p)
+# define CLMUL_STORE(p, v) prv_clmul_store(p, v)
+# define CLMUL_XOR(a, b) veorq_u64(a, b)
+# define CLMUL_FOLD(v, k) prv_clmul_fold(v, k)
+# define CLMUL_CRC(crc) vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t)(crc) << 48))
+#endif
+
+/**
+ * @brief Fold len >= 16 bytes into one 128 bit block and reduce it.
+ * Without xorout, continuing with crc is equal to starting with 0 and
+ * XORing crc into the first two bytes.
+ */
+CLMUL_TARGET
+static uint16_t prv_crc16_clmul(uint16_t crc, const unsigned char *data, size_t len)
+{
+    CLMUL_BSWAP;
+    const clmul_vec k128 = CLMUL_KEYS(prv_keys.k192, prv_keys.k128);
+    const clmul_vec k512 = CLMUL_KEYS(prv_keys.k576, prv_keys.k512);
+    unsigned char last[16];
+
+    clmul_vec x0 = CLMUL_XOR(CLMUL_LOAD(data), CLMUL_CRC(crc));
+    data += 16;
+    len -= 16;
+
+    if (len >= 48) {
+        // Four independent accumulators to hide the multiplication latency
+        clmul_vec x1 = CLMUL_LOAD(data);
+        clmul_vec x2 = CLMUL_LOAD(data+16);
+        clmul_vec x3 = CLMUL_LOAD(data+32);
+        data += 48;
+        len -= 48;
+        while (len >= 64) {
+            x0 = CLMUL_XOR(CLMUL_FOLD(x0, k512), CLMUL_LOAD(data));
+            x1 = CLMUL_XOR(CLMUL_FOLD(x1, k512), CLMUL_LOAD(data+16));
+            x2 = CLMUL_XOR(CLMUL_FOLD(x2, k512), CLMUL_LOAD(data+32));
+            x3 = CLMUL_XOR(CLMUL_FOLD(x3, k512), CLMUL_LOAD(data+48));
+            data += 64;
+            len -= 64;
+        }
+        x0 = CLMUL_XOR(CLMUL_FOLD(x0, k128), x1);
+        x0 = CLMUL_XOR(CLMUL_FOLD(x0, k128), x2);
+        x0 = CLMUL_XOR(CLMUL_FOLD(x0, k128), x3);
+    }
+
+    while (len >= 16) {
+        x0 = CLMUL_XOR(CLMUL_FOLD(x0, k128), CLMUL_LOAD(data));
+        data += 16;
+        len -= 16;
+    }
+
+    CLMUL_STORE(last, x0);
+    crc = prv_crc16_update_portable(0, last, sizeof(last));
+    return prv_crc16_update_portable(crc, data, len);
+}
+
+#endif
+
+uint16_t crc16_ccitt_update(uint16_t crc, const unsigned char *data, size_t len)
+{
+#ifdef BST_CRC16_CLMUL
+    if (len >= CLMUL_MIN_LEN && prv_clmul_available())
+        return prv_crc16_clmul(crc, data, len);
+#endif
+    return prv_crc16_update_portable(crc, data, len);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bootstrapWifiConfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// CRC-16/CCITT-FALSE
+/// width=16 poly=0x1021 init=0xffff refin=false refout=false xorout=0x0000 check=0x29b1 name="CRC-16/CCITT-FALSE"
+#define BST_CRC16_POLY 0x1021
+#define BST_CRC16_INIT 0xffff
+
+#if BST_CRC16_VARIANT == BST_CRC16_NIBBLE_TABLE
+extern const uint16_t bst_crc16_nibble_table[16];
+#elif BST_CRC16_VARIANT == BST_CRC16_BYTE_TABLE
+extern const uint16_t bst_crc16_tables[1][256];
+#elif BST_CRC16_VARIANT == BST_CRC16_SLICING_BY_4
+extern const uint16_t bst_crc16_tables[4][256];
+#elif BST_CRC16_VARIANT == BST_CRC16_SLICING_BY_8
+extern const uint16_t bst_crc16_tables[8][256];
+#endif
+
+/**
+ * @brief Feed one byte into the crc register. Use this in loops that
+ * produce the data byte by byte, otherwise use crc16_ccitt_update().
+ */
+static inline uint16_t crc16_ccitt_byte(uint16_t crc, unsigned char data)
+{
+#if BST_CRC16_VARIANT == BST_CRC16_BITWISE
+    crc ^= data << 8;
+    for (uint8_t i=0; i < 8; i++)
+        crc = (crc & 0x8000) ? ((crc << 1) ^ BST_CRC16_POLY) : (crc << 1);
+    return crc;
+#elif BST_CRC16_VARIANT == BST_CRC16_NIBBLE_TABLE
+    crc ^= data << 8;
+    crc = (crc << 4) ^ bst_crc16_nibble_table[crc >> 12];
+    crc = (crc << 4) ^ bst_crc16_nibble_table[crc >> 12];
+    return crc;
+#else
+    return (crc << 8) ^ bst_crc16_tables[0][(crc >> 8) ^ data];
+#endif
+}
+
+/**
+ * @brief Feed len bytes into the crc register.
+ * @param crc BST_CRC16_INIT or the result of a former call.
+ * @return The new crc register.
+ */
+uint16_t crc16_ccitt_update(uint16_t crc, const unsigned char *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
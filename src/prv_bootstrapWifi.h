@@ -6,6 +6,8 @@
 
 #include "bootstrapWifiConfig.h"
 #include "bootstrapWifi.h"
+#include "spritz.h"
+#include "scheduler.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,6 +15,9 @@ extern "C" {
 
 #define BST_NETWORK_HEADER_SIZE (sizeof(BST_NETWORK_HEADER)-1)
 
+// Header, crc and command/state field are not encrypted.
+#define BST_ENCRYPTED_OFFSET (BST_NETWORK_HEADER_SIZE+BST_CRC_SIZE+1)
+
 typedef enum
 {
     STATE_OK,       // Send with the wifi list and no errors occurred
@@ -28,62 +33,6 @@ typedef enum
     STATE_ERROR_ADVANCED
 } prv_bst_error_state;
 
-typedef struct _instance_ {
-    /// User options which are assigned in bst_setup()
-    /// and will also survive a factory reset.
-    bst_connect_options options;
-
-    /// Storage for below pointers
-    char storage[BST_STORAGE_RAM_SIZE];
-    uint16_t storage_len;
-
-    /// Pointers to ssid, pwd, additional bootstrap data and
-    /// the discovery mode access point password.
-    /// They point to a cstring within "storage".
-    char* ssid;
-    char* pwd;
-    char* additional;
-
-    /// Initially bound_key is set to options.initial_bound_key. This key
-    /// is commonly known and will be used by an app to encrypt/decrypt traffic.
-    /// An app will usually try to bind a device and exchange this key by
-    /// an app instance specific one. If the app instance is lost, the device
-    /// has to be factory reseted to enable bootstrapping again.
-    char crypto_secret[BST_BINDKEY_MAX_SIZE];
-    uint8_t crypto_secret_len;
-
-    struct {
-        const char* error_log_msg;
-        char prv_app_nonce[BST_NONCE_SIZE];
-        char prv_device_nonce[BST_NONCE_SIZE];
-        uint8_t count_connection_attempts;
-        bst_state state;
-        prv_bst_error_state last_error;
-
-        // Only one of those timeouts is used at a time
-        union {
-            time_t timeout_connecting_advanced;
-            time_t timeout_connecting_destination;
-            time_t timeout_connecting_bootstrap_app;
-        };
-        // The bootstrap app establishes a session with its first
-        // HELLO packet. An app session nonce is provided with such
-        // a packet and this library generates a device nonce in response.
-        // The device nonce is valid for bst_connect_options.timeout_nonce_ms.
-        time_t time_nonce_valid;
-    } state;
-
-    // Delayed execution flags. network_input, bst_factory_reset and other
-    // methods only set a flag and the actual execution is done in bst_periodic().
-    struct {
-        uint8_t request_wifi_list:1;
-        uint8_t request_set_wifi:1;
-        uint8_t request_bind:1;
-        uint8_t request_factory_reset:1;
-        uint8_t external_confirmation:1;
-    } flags;
-} instance_t;
-
 typedef enum
 {
     CMD_UNKNOWN,
@@ -144,6 +93,18 @@ typedef struct __attribute__((__packed__)) _bst_udp_send_hello_pkt
     uint8_t state_code; // prv_bst_error_state
 } bst_udp_send_hello_pkt_t;
 
+/// Common start of bst_udp_send_pkt_t and bst_udp_send_paged_pkt_t.
+/// Everything after state_code is encrypted.
+typedef struct __attribute__((__packed__)) _bst_udp_send_hdr
+{
+    char hdr[BST_NETWORK_HEADER_SIZE];
+    bst_crc_value crc; // crc in network byte order
+    uint8_t state_code; // prv_bst_error_state
+    char device_nonce[BST_NONCE_SIZE];
+    char uid[BST_UID_SIZE];
+    uint8_t external_confirmation_state; // one of prv_bst_confirm_state
+} bst_udp_send_hdr_t;
+
 typedef struct __attribute__((__packed__)) _bst_udp_send_pkt
 {
     char hdr[BST_NETWORK_HEADER_SIZE];
@@ -161,15 +122,259 @@ typedef struct __attribute__((__packed__)) _bst_udp_send_pkt
             -sizeof(uint8_t)-BST_NONCE_SIZE-BST_UID_SIZE-3];
 } bst_udp_send_pkt_t;
 
+/// Wifi list response of protocol version 2 and later. The list is split into
+/// page_count packets if it does not fit into one.
+typedef struct __attribute__((__packed__)) _bst_udp_send_paged_pkt
+{
+    char hdr[BST_NETWORK_HEADER_SIZE];
+    bst_crc_value crc; // crc in network byte order
+    uint8_t state_code; // prv_bst_error_state
+    char device_nonce[BST_NONCE_SIZE];
+    char uid[BST_UID_SIZE];
+    uint8_t external_confirmation_state; // one of prv_bst_confirm_state
+    uint8_t wifi_list_size_in_bytes[2]; // network byte order
+    uint8_t wifi_list_entries;
+    uint8_t page; // 0..page_count-1
+    uint8_t page_count;
+    // The wifi list of this page and the (error) log message.
+    char data_wifi_list_and_log_msg[BST_NETWORK_PACKET_SIZE
+            -BST_NETWORK_HEADER_SIZE-sizeof(bst_crc_value)
+            -sizeof(uint8_t)-BST_NONCE_SIZE-BST_UID_SIZE-6];
+} bst_udp_send_paged_pkt_t;
+
+/// Large enough for every packet that the device receives.
+typedef union _bst_udp_receive_any_pkt
+{
+    bst_udp_receive_pkt_t pkt;
+    bst_udp_hello_receive_pkt_t hello;
+    bst_udp_bind_receive_pkt_t bind;
+    bst_udp_bootstrap_receive_pkt_t bootstrap;
+} bst_udp_receive_any_pkt_t;
+
+typedef struct _prv_ingress_slot
+{
+    uint16_t len;
+    bst_udp_receive_any_pkt_t pkt;
+} prv_ingress_slot;
+
+/**
+ * @brief Keystream for outgoing packets. The pages of a paginated wifi list are
+ * encrypted with successive parts of one keystream, offset counts the used bytes.
+ */
+typedef struct _prv_send_stream {
+    spritz_state state;
+    size_t offset;
+    bool started;
+} prv_send_stream;
+
+/// Fast reconnect record. It is appended to the stored bootstrap data, right after
+/// ssid\0pwd\0additional\0. Data stored by older versions has zeros there instead.
+#define BST_CONNECT_HINT_MARKER 0xC4
+typedef struct __attribute__((__packed__)) _prv_connect_hint_record
+{
+    uint8_t marker; // == BST_CONNECT_HINT_MARKER
+    bst_connect_hint hint;
+    bst_crc_value crc; // crc of hint
+} prv_connect_hint_record;
+
+#if BST_INGRESS_RING_SLOTS < 1 || BST_INGRESS_RING_SLOTS > 128 || (BST_INGRESS_RING_SLOTS & (BST_INGRESS_RING_SLOTS-1))
+#error BST_INGRESS_RING_SLOTS has to be a power of two not larger than 128
+#endif
+
+#if defined(BST_TRACE) && (BST_TRACE_SLOTS < 1 || BST_TRACE_SLOTS > 32768 || (BST_TRACE_SLOTS & (BST_TRACE_SLOTS-1)))
+#error BST_TRACE_SLOTS has to be a power of two not larger than 32768
+#endif
+
+/// The state of one bootstrap state machine, see bst_ctx_t.
+typedef struct _instance_ {
+    /// Platform callbacks and their user pointer, assigned in bst_ctx_setup().
+    const bst_callbacks* callbacks;
+    void* user;
+
+    /// Node of the bst_scheduler the context is added to, if any.
+    bst_timer timer;
+
+    /// User options which are assigned in bst_setup()
+    /// and will also survive a factory reset.
+    bst_connect_options options;
+
+    /// Storage for below pointers
+    char storage[BST_STORAGE_RAM_SIZE];
+    uint16_t storage_len;
+
+    /// Pointers to ssid, pwd, additional bootstrap data and
+    /// the discovery mode access point password.
+    /// They point to a cstring within "storage".
+    char* ssid;
+    char* pwd;
+    char* additional;
+
+    /// Initially bound_key is set to options.initial_bound_key. This key
+    /// is commonly known and will be used by an app to encrypt/decrypt traffic.
+    /// An app will usually try to bind a device and exchange this key by
+    /// an app instance specific one. If the app instance is lost, the device
+    /// has to be factory reseted to enable bootstrapping again.
+    char crypto_secret[BST_BINDKEY_MAX_SIZE];
+    uint8_t crypto_secret_len;
+
+    /// Spritz state with crypto_secret already absorbed. It is renewed
+    /// whenever crypto_secret changes and is cloned for every packet.
+    spritz_keyed_ctx crypto_ctx;
+
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+    /// Keystream for outgoing packets, generated with crypto_ctx and the app nonce
+    /// in idle bst_periodic() calls. "state" continues right after the last
+    /// precomputed byte. Only valid if "started" is set and "nonce" equals the app nonce.
+    struct {
+        spritz_state state;
+        unsigned char data[BST_NETWORK_PACKET_SIZE-BST_ENCRYPTED_OFFSET];
+        uint16_t len;
+        char nonce[BST_NONCE_SIZE];
+        bool started;
+    } keystream;
+#endif
+
+    struct {
+        const char* error_log_msg;
+        char prv_app_nonce[BST_NONCE_SIZE];
+        char prv_device_nonce[BST_NONCE_SIZE];
+        uint8_t count_connection_attempts;
+        // Reconnection attempts since the last successful connection, for the backoff.
+        // Survives mode changes.
+        uint8_t reconnect_attempts;
+        bst_state state;
+        prv_bst_error_state last_error;
+        // Protocol version of the app session, taken from the header of its HELLO packet
+        uint8_t protocol_version;
+
+        // Only one of those timeouts is used at a time
+        union {
+            time_t timeout_connecting_advanced;
+            time_t timeout_connecting_destination;
+            time_t timeout_connecting_bootstrap_app;
+        };
+        // The bootstrap app establishes a session with its first
+        // HELLO packet. An app session nonce is provided with such
+        // a packet and this library generates a device nonce in response.
+        // The device nonce is valid for bst_connect_options.timeout_nonce_ms.
+        time_t time_nonce_valid;
+    } state;
+
+    /// Token bucket for incoming packets, see prv_take_input_token().
+    /// Counts the used tokens, so that a zeroed instance starts with a full bucket.
+    struct {
+        uint8_t spent;
+        time_t last_refill;
+    } input_rate;
+
+    /// Kept by a factory reset, like the ingress ring that has to follow it.
+    bst_input_stats input_stats;
+
+    /// Single producer (bst_network_input) single consumer (bst_periodic) ring
+    /// of received packets. head is only written by the producer, tail only by
+    /// the consumer. Both are free running, the slot index is masked.
+    struct {
+        prv_ingress_slot slots[BST_INGRESS_RING_SLOTS];
+        uint8_t head;
+        uint8_t tail;
+    } ingress;
+
+    /// Last state of bst_connection_event(), if options.connection_events is set.
+    /// "changed" is set by bst_connection_event() and cleared by bst_periodic().
+    struct {
+        uint8_t state;
+        uint8_t changed;
+    } connection_event;
+
+    /// Discovery of the bootstrap network, if options.bootstrap_discovery_interval_ms is set.
+    /// "seen" is set by bst_ctx_bootstrap_network_found() and cleared by bst_periodic().
+    /// "channel" is the channel of the last sighting and survives mode changes.
+    struct {
+        uint8_t seen;
+        uint8_t channel;
+    } discovery;
+
+#ifdef BST_TRACE
+    /// Ring of the last BST_TRACE_SLOTS trace records, the oldest record is overwritten
+    /// if it is full. head and tail are free running, the slot index is masked.
+    struct {
+        bst_trace_record records[BST_TRACE_SLOTS];
+        uint16_t head;
+        uint16_t tail;
+    } trace;
+#endif
+
+    /// Fast reconnect hint of bst_ctx_set_connect_hint() or of the stored bootstrap data.
+    /// "offset" is the position of the hint record in "storage", right after the strings.
+    /// "used" is set if the running connection attempt to the destination uses the hint,
+    /// "failed" if such an attempt did not succeed. A failed hint is not used again
+    /// until the platform reports a new one.
+    struct {
+        bst_connect_hint hint;
+        uint16_t offset;
+        bool valid;
+        bool used;
+        bool failed;
+    } connect_hint;
+
+    // Delayed execution flags. network_input, bst_factory_reset and other
+    // methods only set a flag and the actual execution is done in bst_periodic().
+    struct {
+        uint8_t request_wifi_list:1;
+        uint8_t request_set_wifi:1;
+        uint8_t request_bind:1;
+        uint8_t request_factory_reset:1;
+        uint8_t external_confirmation:1;
+        uint8_t wifi_list_response_pending:1;
+    } flags;
+
+    /// Wifi list responses are assembled and encrypted here instead of on the stack,
+    /// only used within prv_send_wifi_list().
+    struct {
+        union {
+            bst_udp_send_pkt_t pkt;
+            bst_udp_send_paged_pkt_t paged;
+        } p;
+        prv_send_stream stream;
+        bst_wifi_list_entry_t sorted[BST_WIFI_LIST_MAX_ENTRIES];
+    } send;
+
+#ifdef BST_WIFI_SCAN_CACHE
+    /// The last scan result, if options.wifi_scan_cache_ttl_ms is set. "list" points
+    /// to the first of "entries" or is NULL, the ssids point into "ssids".
+    /// "refreshes" counts the background scans since entering BST_MODE_WAITING_FOR_DATA.
+    struct {
+        bst_wifi_list_entry_t entries[BST_WIFI_LIST_MAX_ENTRIES];
+        char ssids[BST_WIFI_SCAN_CACHE_SIZE];
+        bst_wifi_list_entry_t* list;
+        time_t valid_until;
+        time_t next_refresh;
+        uint8_t refreshes;
+    } scan_cache;
+#endif
+} instance_t;
+
+/// The context of the bst_* functions without a context parameter.
 extern instance_t prv_instance;
 
 bst_crc_value bst_crc16(const unsigned char *pData, uint16_t size);
 
+/// Resumable crc16 for data that is serialized or received in fragments.
+/// The concatenation of all updates results in the same value as bst_crc16().
+typedef struct _bst_crc16_ctx
+{
+    uint16_t crc;
+} bst_crc16_ctx;
+
+void bst_crc16_init(bst_crc16_ctx* ctx);
+void bst_crc16_update(bst_crc16_ctx* ctx, const void *pData, size_t size);
+bst_crc_value bst_crc16_final(const bst_crc16_ctx* ctx);
+
 // Make some methods only available on the test suite, otherwise they are static inlined.
 #ifdef BST_TEST_SUITE
-bool prv_check_header_and_decrypt(bst_udp_receive_pkt_t* pkt, size_t pkt_len);
-void prv_add_header(bst_udp_send_pkt_t* pkt);
-void prv_add_checksum_and_encrypt(bst_udp_send_pkt_t* pkt, size_t pkt_len);
+bool prv_check_header_and_decrypt(bst_ctx_t* ctx, bst_udp_receive_pkt_t* pkt, size_t pkt_len);
+void prv_add_header(bst_ctx_t* ctx, bst_udp_send_hdr_t* pkt);
+void prv_add_checksum_and_encrypt(bst_ctx_t* ctx, bst_udp_send_hdr_t* pkt, size_t pkt_len);
 bool prv_crc16_is_valid(bst_udp_receive_pkt_t* pkt, size_t pkt_len);
 #endif
 
@@ -0,0 +1,116 @@
+#include "scheduler.h"
+#include "prv_bootstrapWifi.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if (BST_SCHEDULER_SLOTS & (BST_SCHEDULER_SLOTS-1)) != 0
+#error BST_SCHEDULER_SLOTS has to be a power of two
+#endif
+
+/// The first tick that is not earlier than the given time
+static inline time_t prv_tick(time_t time_ms)
+{
+    return (time_ms + BST_SCHEDULER_TICK_MS - 1) / BST_SCHEDULER_TICK_MS;
+}
+
+static inline void prv_unlink(bst_timer* timer)
+{
+    if (!timer->pprev)
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static inline void prv_link(bst_timer** list, bst_timer* timer)
+{
+    timer->next = *list;
+    timer->pprev = list;
+    if (*list)
+        (*list)->pprev = &timer->next;
+    *list = timer;
+}
+
+static void prv_insert(bst_scheduler* scheduler, bst_timer* timer, time_t due_tick)
+{
+    // Expired deadlines are processed in the next tick
+    if (due_tick <= scheduler->current_tick)
+        due_tick = scheduler->current_tick + 1;
+
+    timer->due_tick = due_tick;
+    prv_link(&scheduler->slots[due_tick & (BST_SCHEDULER_SLOTS-1)], timer);
+}
+
+static inline bst_ctx_t* prv_timer_ctx(bst_timer* timer)
+{
+    return (bst_ctx_t*)((char*)timer - offsetof(bst_ctx_t, timer));
+}
+
+void bst_scheduler_init(bst_scheduler* scheduler, time_t now)
+{
+    memset(scheduler, 0, sizeof(bst_scheduler));
+    scheduler->current_tick = now / BST_SCHEDULER_TICK_MS;
+}
+
+void bst_scheduler_add(bst_scheduler* scheduler, bst_ctx_t* ctx)
+{
+    prv_unlink(&ctx->timer);
+    prv_insert(scheduler, &ctx->timer, prv_tick(bst_ctx_next_wakeup_ms(ctx)));
+}
+
+void bst_scheduler_remove(bst_ctx_t* ctx)
+{
+    prv_unlink(&ctx->timer);
+}
+
+void bst_scheduler_wake(bst_scheduler* scheduler, bst_ctx_t* ctx)
+{
+    prv_unlink(&ctx->timer);
+    prv_insert(scheduler, &ctx->timer, scheduler->current_tick + 1);
+}
+
+size_t bst_scheduler_run(bst_scheduler* scheduler, time_t now)
+{
+    const time_t now_tick = now / BST_SCHEDULER_TICK_MS;
+    if (now_tick <= scheduler->current_tick)
+        return 0;
+
+    // Every slot is visited at most once, even after a long pause.
+    time_t ticks = now_tick - scheduler->current_tick;
+    if (ticks > BST_SCHEDULER_SLOTS)
+        ticks = BST_SCHEDULER_SLOTS;
+
+    // Collect the expired timers first, stepping a context reschedules it.
+    // The list is linked like a slot: A callback that wakes or removes another
+    // expired context unlinks it from here.
+    bst_timer* expired = NULL;
+    for (time_t tick = now_tick - ticks + 1; tick <= now_tick; ++tick) {
+        bst_timer* timer = scheduler->slots[tick & (BST_SCHEDULER_SLOTS-1)];
+        while (timer) {
+            bst_timer* next = timer->next;
+            if (timer->due_tick <= now_tick) {
+                prv_unlink(timer);
+                prv_link(&expired, timer);
+            }
+            timer = next;
+        }
+    }
+    scheduler->current_tick = now_tick;
+
+    size_t stepped = 0;
+    while (expired) {
+        bst_timer* timer = expired;
+        prv_unlink(timer);
+
+        bst_ctx_t* ctx = prv_timer_ctx(timer);
+        bst_ctx_periodic(ctx);
+        ++stepped;
+        // Already scheduled if a callback woke the context up
+        if (!timer->pprev)
+            prv_insert(scheduler, timer, prv_tick(bst_ctx_next_wakeup_ms(ctx)));
+    }
+    return stepped;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bootstrapWifiConfig.h"
+#include "bootstrapWifi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Hashed timer wheel for hosts that run many contexts (see bst_ctx_t), for example
+/// a gateway or a simulator. Every context is stepped with bst_ctx_periodic() only if
+/// its deadline (bst_ctx_next_wakeup_ms()) expired or it was woken up with
+/// bst_scheduler_wake(). A tick costs O(expired contexts) instead of O(contexts).
+///
+/// Deadlines are rounded up to BST_SCHEDULER_TICK_MS. A deadline is put into the
+/// slot (deadline tick % BST_SCHEDULER_SLOTS). Insert and remove are O(1).
+///
+/// The scheduler is not thread safe. Call bst_scheduler_wake() in the same thread
+/// after bst_ctx_network_input() or bst_ctx_connection_event().
+
+/// A node of the wheel. Every context contains one, do not access the members.
+typedef struct bst_timer {
+    struct bst_timer* next;
+    struct bst_timer** pprev; ///< Pointer to the "next" pointer that points to this node or NULL
+    time_t due_tick;
+} bst_timer;
+
+typedef struct bst_scheduler {
+    bst_timer* slots[BST_SCHEDULER_SLOTS];
+    /// Every tick up to and including this one is processed
+    time_t current_tick;
+} bst_scheduler;
+
+/**
+ * @brief Initialize an empty scheduler.
+ * @param now The current time in ms, the time base of bst_get_system_time_ms().
+ */
+void bst_scheduler_init(bst_scheduler* scheduler, time_t now);
+
+/**
+ * @brief Add a context that is already set up with bst_ctx_setup(). It is
+ * scheduled at bst_ctx_next_wakeup_ms().
+ */
+void bst_scheduler_add(bst_scheduler* scheduler, bst_ctx_t* ctx);
+
+/// Remove a context. Does nothing if the context is not added. Remove a context
+/// before calling bst_ctx_setup() on it again. Not allowed in a callback of the context.
+void bst_scheduler_remove(bst_ctx_t* ctx);
+
+/// Step the context in the next tick, for example after a packet was received.
+void bst_scheduler_wake(bst_scheduler* scheduler, bst_ctx_t* ctx);
+
+/**
+ * @brief Call bst_ctx_periodic() for every context with an expired deadline
+ * and schedule it again at its next deadline.
+ * @param now The current time in ms.
+ * @return The number of stepped contexts.
+ */
+size_t bst_scheduler_run(bst_scheduler* scheduler, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
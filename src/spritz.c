@@ -1,11 +1,32 @@
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "spritz.h"
 
 #define N 256
 
+// SPRITZ_FAST_SHUFFLE: Use an unrolled whip() with the state indices in local
+// variables and SIMD for crush() and for combining keystream and message.
+// Enabled by default for host builds with SSE2 or NEON. Microcontroller builds
+// (Xtensa etc.) use the portable implementation with SWAR combining.
+#if !defined(SPRITZ_FAST_SHUFFLE) && !defined(SPRITZ_PORTABLE_SHUFFLE)
+# if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define SPRITZ_FAST_SHUFFLE
+# endif
+#endif
+
+#ifdef SPRITZ_FAST_SHUFFLE
+# if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define SPRITZ_SIMD_SSE2
+# elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define SPRITZ_SIMD_NEON
+# endif
+#endif
+
 #if defined(_MSC_VER)
 # define ALIGNED(S) __declspec(align(S))
 #elif defined(__GNUC__)
@@ -14,15 +35,10 @@
 # define ALIGNED(S)
 #endif
 
-ALIGNED(64) typedef struct State_ {
-    unsigned char s[N];
-    unsigned char a;
-    unsigned char i;
-    unsigned char j;
-    unsigned char k;
-    unsigned char w;
-    unsigned char z;
-} State;
+// spritz_state itself is not over-aligned, it is embedded in caller provided
+// memory (see bst_ctx_size()). The states of this file are aligned instead,
+// so that s[] occupies 4 cache lines and not 5.
+typedef spritz_state State;
 
 #define LOW(B)  ((B) & 0xf)
 #define HIGH(B) ((B) >> 4)
@@ -86,6 +102,63 @@ output(State *state)
     return state->z;
 }
 
+#if defined(SPRITZ_SIMD_SSE2)
+
+// Reverse the byte order of a 128 bit vector with SSE2 only instructions.
+static inline __m128i
+reverse_bytes(__m128i x)
+{
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+    x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+// s[v] and s[N-1-v] are sorted pairwise: Compare 16 bytes from the front
+// with the reversed 16 bytes from the back of the state.
+static void
+crush(State *state)
+{
+    unsigned int v;
+
+    for (v = 0; v < N / 2; v += 16) {
+        unsigned char *front = &state->s[v];
+        unsigned char *back = &state->s[N - 16 - v];
+        __m128i        x1 = _mm_loadu_si128((const __m128i *) front);
+        __m128i        x2 = reverse_bytes(_mm_loadu_si128((const __m128i *) back));
+
+        _mm_storeu_si128((__m128i *) front, _mm_min_epu8(x1, x2));
+        _mm_storeu_si128((__m128i *) back, reverse_bytes(_mm_max_epu8(x1, x2)));
+    }
+}
+
+#elif defined(SPRITZ_SIMD_NEON)
+
+static inline uint8x16_t
+reverse_bytes(uint8x16_t x)
+{
+    x = vrev64q_u8(x);
+    return vextq_u8(x, x, 8);
+}
+
+static void
+crush(State *state)
+{
+    unsigned int v;
+
+    for (v = 0; v < N / 2; v += 16) {
+        unsigned char *front = &state->s[v];
+        unsigned char *back = &state->s[N - 16 - v];
+        uint8x16_t     x1 = vld1q_u8(front);
+        uint8x16_t     x2 = reverse_bytes(vld1q_u8(back));
+
+        vst1q_u8(front, vminq_u8(x1, x2));
+        vst1q_u8(back, reverse_bytes(vmaxq_u8(x1, x2)));
+    }
+}
+
+#else
+
 static void
 crush(State *state)
 {
@@ -108,6 +181,46 @@ crush(State *state)
     }
 }
 
+#endif
+
+#ifdef SPRITZ_FAST_SHUFFLE
+
+// update() on local copies of i, j, k and w.
+#define UPDATE_LOCAL(s, i, j, k, w) do {    \
+        unsigned char t_;                   \
+        i += w;                             \
+        j = k + s[(unsigned char)(j + s[i])]; \
+        k = i + k + s[j];                   \
+        t_ = s[i];                          \
+        s[i] = s[j];                        \
+        s[j] = t_;                          \
+    } while (0)
+
+static void
+whip(State *state)
+{
+    const unsigned int r = N * 2;
+    unsigned int       v;
+    unsigned char     *s = state->s;
+    unsigned char      i = state->i;
+    unsigned char      j = state->j;
+    unsigned char      k = state->k;
+    const unsigned char w = state->w;
+
+    for (v = 0; v < r; v += 4) {
+        UPDATE_LOCAL(s, i, j, k, w);
+        UPDATE_LOCAL(s, i, j, k, w);
+        UPDATE_LOCAL(s, i, j, k, w);
+        UPDATE_LOCAL(s, i, j, k, w);
+    }
+    state->i = i;
+    state->j = j;
+    state->k = k;
+    state->w += 2;
+}
+
+#else
+
 static void
 whip(State *state)
 {
@@ -120,6 +233,8 @@ whip(State *state)
     state->w += 2;
 }
 
+#endif
+
 static void
 shuffle(State *state)
 {
@@ -173,28 +288,107 @@ absorb(State *state, const unsigned char *msg, size_t length)
     }
 }
 
-static unsigned char
-drip(State *state)
+// Generate len keystream bytes. update() and output() are inlined with the state
+// indices in local variables. The state must not have absorbed data (a == 0).
+static void
+keystream_block(State *state, unsigned char *out, size_t len)
 {
-    if (state->a > 0) {
-        shuffle(state);
+    unsigned char      *s = state->s;
+    unsigned char       i = state->i;
+    unsigned char       j = state->j;
+    unsigned char       k = state->k;
+    unsigned char       z = state->z;
+    const unsigned char w = state->w;
+    size_t              v;
+
+    for (v = 0; v < len; v++) {
+        unsigned char t;
+
+        i += w;
+        j = k + s[(unsigned char) (j + s[i])];
+        k = i + k + s[j];
+        t = s[i];
+        s[i] = s[j];
+        s[j] = t;
+
+        z = s[(unsigned char) (j + s[(unsigned char) (i + s[(unsigned char) (z + k)])])];
+        out[v] = z;
     }
-    update(state);
+    state->i = i;
+    state->j = j;
+    state->k = k;
+    state->z = z;
+}
 
-    return output(state);
+// out = msg + ks, bytewise modulo 256
+static void
+combine_add(unsigned char *out, const unsigned char *msg, const unsigned char *ks, size_t len)
+{
+    size_t v = 0;
+
+#if defined(SPRITZ_SIMD_SSE2)
+    for (; v + 16 <= len; v += 16) {
+        __m128i m = _mm_loadu_si128((const __m128i *) (msg + v));
+        __m128i k = _mm_loadu_si128((const __m128i *) (ks + v));
+        _mm_storeu_si128((__m128i *) (out + v), _mm_add_epi8(m, k));
+    }
+#elif defined(SPRITZ_SIMD_NEON)
+    for (; v + 16 <= len; v += 16) {
+        vst1q_u8(out + v, vaddq_u8(vld1q_u8(msg + v), vld1q_u8(ks + v)));
+    }
+#else
+    // SWAR: add four bytes in a 32 bit word without carrying into the next byte.
+    for (; v + 4 <= len; v += 4) {
+        uint32_t m, k, r;
+        memcpy(&m, msg + v, 4);
+        memcpy(&k, ks + v, 4);
+        r = ((m & 0x7f7f7f7fU) + (k & 0x7f7f7f7fU)) ^ ((m ^ k) & 0x80808080U);
+        memcpy(out + v, &r, 4);
+    }
+#endif
+    for (; v < len; v++) {
+        out[v] = msg[v] + ks[v];
+    }
 }
 
+// out = c - ks, bytewise modulo 256
 static void
-squeeze(State *state, unsigned char *out, size_t outlen)
+combine_sub(unsigned char *out, const unsigned char *c, const unsigned char *ks, size_t len)
 {
-    size_t v;
+    size_t v = 0;
+
+#if defined(SPRITZ_SIMD_SSE2)
+    for (; v + 16 <= len; v += 16) {
+        __m128i m = _mm_loadu_si128((const __m128i *) (c + v));
+        __m128i k = _mm_loadu_si128((const __m128i *) (ks + v));
+        _mm_storeu_si128((__m128i *) (out + v), _mm_sub_epi8(m, k));
+    }
+#elif defined(SPRITZ_SIMD_NEON)
+    for (; v + 16 <= len; v += 16) {
+        vst1q_u8(out + v, vsubq_u8(vld1q_u8(c + v), vld1q_u8(ks + v)));
+    }
+#else
+    // SWAR: subtract four bytes in a 32 bit word without borrowing from the next byte.
+    for (; v + 4 <= len; v += 4) {
+        uint32_t m, k, r;
+        memcpy(&m, c + v, 4);
+        memcpy(&k, ks + v, 4);
+        r = ((m | 0x80808080U) - (k & 0x7f7f7f7fU)) ^ ((m ^ ~k) & 0x80808080U);
+        memcpy(out + v, &r, 4);
+    }
+#endif
+    for (; v < len; v++) {
+        out[v] = c[v] - ks[v];
+    }
+}
 
+static void
+squeeze(State *state, unsigned char *out, size_t outlen)
+{
     if (state->a > 0) {
         shuffle(state);
     }
-    for (v = 0; v < outlen; v++) {
-        out[v] = drip(state);
-    }
+    keystream_block(state, out, outlen);
 }
 
 static void
@@ -208,7 +402,7 @@ int
 spritz_hash(unsigned char *out, size_t outlen,
             const unsigned char *msg, size_t msglen)
 {
-    State         state;
+    ALIGNED(64) State state;
     unsigned char r;
 
     if (outlen > 255) {
@@ -229,7 +423,7 @@ int
 spritz_stream(unsigned char *out, size_t outlen,
               const unsigned char *key, size_t keylen)
 {
-    State state;
+    ALIGNED(64) State state;
 
     initialize_state(&state);
     absorb(&state, key, keylen);
@@ -239,21 +433,135 @@ spritz_stream(unsigned char *out, size_t outlen,
     return 0;
 }
 
+int
+spritz_keyed_setup(spritz_keyed_ctx *ctx,
+                   const unsigned char *key, size_t keylen)
+{
+    key_setup(ctx, key, keylen);
+    absorb_stop(ctx);
+
+    return 0;
+}
+
+int
+spritz_keyed_encrypt(unsigned char *out, const unsigned char *msg, size_t msglen,
+                     const unsigned char *nonce, size_t noncelen,
+                     const spritz_keyed_ctx *ctx)
+{
+    ALIGNED(64) State state;
+
+    spritz_keyed_start(&state, nonce, noncelen, ctx);
+    spritz_encrypt_update(&state, out, msg, msglen);
+    memzero(&state, sizeof state);
+
+    return 0;
+}
+
+int
+spritz_keyed_decrypt(unsigned char *out, const unsigned char *c, size_t clen,
+                     const unsigned char *nonce, size_t noncelen,
+                     const spritz_keyed_ctx *ctx)
+{
+    ALIGNED(64) State state;
+
+    spritz_keyed_start(&state, nonce, noncelen, ctx);
+    spritz_decrypt_update(&state, out, c, clen);
+    memzero(&state, sizeof state);
+
+    return 0;
+}
+
+void
+spritz_keyed_wipe(spritz_keyed_ctx *ctx)
+{
+    memzero(ctx, sizeof *ctx);
+}
+
+void
+spritz_init(spritz_state *state)
+{
+    initialize_state(state);
+}
+
+void
+spritz_absorb(spritz_state *state, const unsigned char *msg, size_t msglen)
+{
+    absorb(state, msg, msglen);
+}
+
+void
+spritz_absorb_stop(spritz_state *state)
+{
+    absorb_stop(state);
+}
+
+void
+spritz_keyed_start(spritz_state *state,
+                   const unsigned char *nonce, size_t noncelen,
+                   const spritz_keyed_ctx *ctx)
+{
+    memcpy(state, ctx, sizeof *state);
+    absorb(state, nonce, noncelen);
+}
+
+void
+spritz_squeeze(spritz_state *state, unsigned char *out, size_t outlen)
+{
+    squeeze(state, out, outlen);
+}
+
+void
+spritz_encrypt_update(spritz_state *state, unsigned char *out,
+                      const unsigned char *msg, size_t msglen)
+{
+    unsigned char ks[SPRITZ_KEYSTREAM_BLOCK];
+
+    while (msglen) {
+        size_t len = msglen < SPRITZ_KEYSTREAM_BLOCK ? msglen : SPRITZ_KEYSTREAM_BLOCK;
+
+        squeeze(state, ks, len);
+        combine_add(out, msg, ks, len);
+        out += len;
+        msg += len;
+        msglen -= len;
+    }
+    memzero(ks, sizeof ks);
+}
+
+void
+spritz_decrypt_update(spritz_state *state, unsigned char *out,
+                      const unsigned char *c, size_t clen)
+{
+    unsigned char ks[SPRITZ_KEYSTREAM_BLOCK];
+
+    while (clen) {
+        size_t len = clen < SPRITZ_KEYSTREAM_BLOCK ? clen : SPRITZ_KEYSTREAM_BLOCK;
+
+        squeeze(state, ks, len);
+        combine_sub(out, c, ks, len);
+        out += len;
+        c += len;
+        clen -= len;
+    }
+    memzero(ks, sizeof ks);
+}
+
+void
+spritz_wipe(spritz_state *state)
+{
+    memzero(state, sizeof *state);
+}
+
 int
 spritz_encrypt(unsigned char *out, const unsigned char *msg, size_t msglen,
                const unsigned char *nonce, size_t noncelen,
                const unsigned char *key, size_t keylen)
 {
-    State  state;
-    size_t v;
+    spritz_keyed_ctx ctx;
 
-    key_setup(&state, key, keylen);
-    absorb_stop(&state);
-    absorb(&state, nonce, noncelen);
-    for (v = 0; v < msglen; v++) {
-        out[v] = msg[v] + drip(&state);
-    }
-    memzero(&state, sizeof state);
+    spritz_keyed_setup(&ctx, key, keylen);
+    spritz_keyed_encrypt(out, msg, msglen, nonce, noncelen, &ctx);
+    memzero(&ctx, sizeof ctx);
 
     return 0;
 }
@@ -263,16 +571,132 @@ spritz_decrypt(unsigned char *out, const unsigned char *c, size_t clen,
                const unsigned char *nonce, size_t noncelen,
                const unsigned char *key, size_t keylen)
 {
-    State  state;
-    size_t v;
+    spritz_keyed_ctx ctx;
 
-    key_setup(&state, key, keylen);
-    absorb_stop(&state);
-    absorb(&state, nonce, noncelen);
-    for (v = 0; v < clen; v++) {
-        out[v] = c[v] - drip(&state);
+    spritz_keyed_setup(&ctx, key, keylen);
+    spritz_keyed_decrypt(out, c, clen, nonce, noncelen, &ctx);
+    memzero(&ctx, sizeof ctx);
+
+    return 0;
+}
+
+static void
+whip_multi(State *states, size_t count)
+{
+    const unsigned int r = N * 2;
+    unsigned int       v;
+    size_t             l;
+
+    for (v = 0; v < r; v++) {
+        for (l = 0; l < count; l++) {
+            update(&states[l]);
+        }
+    }
+    for (l = 0; l < count; l++) {
+        states[l].w += 2;
+    }
+}
+
+static void
+shuffle_multi(State *states, size_t count)
+{
+    size_t l;
+
+    whip_multi(states, count);
+    for (l = 0; l < count; l++) {
+        crush(&states[l]);
+    }
+    whip_multi(states, count);
+    for (l = 0; l < count; l++) {
+        crush(&states[l]);
+    }
+    whip_multi(states, count);
+    for (l = 0; l < count; l++) {
+        states[l].a = 0;
+    }
+}
+
+static void
+crypt_multi(const spritz_lane *lanes, size_t count, int decrypt)
+{
+    ALIGNED(64) State states[SPRITZ_MULTI_LANES];
+    unsigned char active[SPRITZ_MULTI_LANES];
+    size_t        active_count = 0;
+    size_t        pos = 0;
+    size_t        l;
+
+    for (l = 0; l < count; l++) {
+        spritz_keyed_start(&states[l], lanes[l].nonce, lanes[l].noncelen, lanes[l].ctx);
+        if (lanes[l].len) {
+            active[active_count++] = (unsigned char) l;
+        }
+    }
+
+    // A freshly keyed state always has absorbed data (a > 0) and needs a shuffle
+    // before its first output byte, do this for all lanes at once.
+    shuffle_multi(states, count);
+
+    while (active_count) {
+        // Run all active lanes in lock-step up to the shortest remaining message.
+        size_t end = lanes[active[0]].len;
+        size_t v;
+
+        for (l = 1; l < active_count; l++) {
+            if (lanes[active[l]].len < end) {
+                end = lanes[active[l]].len;
+            }
+        }
+
+        for (v = pos; v < end; v++) {
+            for (l = 0; l < active_count; l++) {
+                State         *state = &states[active[l]];
+                unsigned char  ks;
+
+                update(state);
+                ks = output(state);
+                lanes[active[l]].out[v] = decrypt ? lanes[active[l]].in[v] - ks
+                                                  : lanes[active[l]].in[v] + ks;
+            }
+        }
+        pos = end;
+
+        // Remove finished lanes
+        for (l = 0; l < active_count;) {
+            if (lanes[active[l]].len == pos) {
+                active[l] = active[--active_count];
+            } else {
+                l++;
+            }
+        }
+    }
+
+    memzero(states, sizeof(State) * count);
+}
+
+int
+spritz_encrypt_multi(const spritz_lane *lanes, size_t lane_count)
+{
+    while (lane_count) {
+        size_t count = lane_count < SPRITZ_MULTI_LANES ? lane_count : SPRITZ_MULTI_LANES;
+
+        crypt_multi(lanes, count, 0);
+        lanes += count;
+        lane_count -= count;
+    }
+
+    return 0;
+}
+
+int
+spritz_decrypt_multi(const spritz_lane *lanes, size_t lane_count)
+{
+    while (lane_count) {
+        size_t count = lane_count < SPRITZ_MULTI_LANES ? lane_count : SPRITZ_MULTI_LANES;
+
+        crypt_multi(lanes, count, 1);
+        lanes += count;
+        lane_count -= count;
     }
-    memzero(&state, sizeof state);
 
     return 0;
 }
@@ -282,7 +706,7 @@ spritz_auth(unsigned char *out, size_t outlen,
             const unsigned char *msg, size_t msglen,
             const unsigned char *key, size_t keylen)
 {
-    State         state;
+    ALIGNED(64) State state;
     unsigned char r;
 
     if (outlen > 255) {
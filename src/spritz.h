@@ -1,9 +1,28 @@
 #pragma once
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/// Spritz state. Do not access the members directly, they are only
+/// public to allow the state to be placed in caller provided memory.
+typedef struct spritz_state_ {
+    unsigned char s[256];
+    unsigned char a;
+    unsigned char i;
+    unsigned char j;
+    unsigned char k;
+    unsigned char w;
+    unsigned char z;
+} spritz_state;
+
+/// A spritz state that already absorbed a key. Set it up once per key with
+/// spritz_keyed_setup() and use it for any number of messages, it is not
+/// modified by spritz_keyed_encrypt()/spritz_keyed_decrypt().
+typedef spritz_state spritz_keyed_ctx;
+
 int spritz_hash(unsigned char *out, size_t outlen,
                 const unsigned char *msg, size_t msglen);
 
@@ -18,6 +37,84 @@ int spritz_decrypt(unsigned char *out, const unsigned char *c, size_t clen,
                    const unsigned char *nonce, size_t noncelen,
                    const unsigned char *key, size_t keylen);
 
+int spritz_keyed_setup(spritz_keyed_ctx *ctx,
+                       const unsigned char *key, size_t keylen);
+
+int spritz_keyed_encrypt(unsigned char *out, const unsigned char *msg, size_t msglen,
+                         const unsigned char *nonce, size_t noncelen,
+                         const spritz_keyed_ctx *ctx);
+
+int spritz_keyed_decrypt(unsigned char *out, const unsigned char *c, size_t clen,
+                         const unsigned char *nonce, size_t noncelen,
+                         const spritz_keyed_ctx *ctx);
+
+void spritz_keyed_wipe(spritz_keyed_ctx *ctx);
+
+/// Streaming interface. A state can be suspended and resumed at any time, for
+/// example to encrypt or decrypt a packet in fragments as they arrive:
+///
+///   spritz_keyed_start(&state, nonce, noncelen, &keyed_ctx);
+///   spritz_decrypt_update(&state, out, fragment1, fragment1_len);
+///   spritz_decrypt_update(&state, out+fragment1_len, fragment2, fragment2_len);
+///   spritz_wipe(&state);
+///
+/// Concatenated updates produce the same output as the one-shot functions.
+
+void spritz_init(spritz_state *state);
+
+void spritz_absorb(spritz_state *state, const unsigned char *msg, size_t msglen);
+
+void spritz_absorb_stop(spritz_state *state);
+
+/// Copy the keyed context into state and absorb the nonce.
+/// Equal to spritz_init(), spritz_absorb(key), spritz_absorb_stop(), spritz_absorb(nonce).
+void spritz_keyed_start(spritz_state *state,
+                        const unsigned char *nonce, size_t noncelen,
+                        const spritz_keyed_ctx *ctx);
+
+void spritz_squeeze(spritz_state *state, unsigned char *out, size_t outlen);
+
+/// out = msg + keystream. out and msg may point to the same memory.
+void spritz_encrypt_update(spritz_state *state, unsigned char *out,
+                           const unsigned char *msg, size_t msglen);
+
+/// out = c - keystream. out and c may point to the same memory.
+void spritz_decrypt_update(spritz_state *state, unsigned char *out,
+                           const unsigned char *c, size_t clen);
+
+void spritz_wipe(spritz_state *state);
+
+/// Keystream bytes generated at once before they are combined with the message
+/// (stack memory). Also used by callers that generate the keystream themselves.
+#ifndef SPRITZ_KEYSTREAM_BLOCK
+#define SPRITZ_KEYSTREAM_BLOCK 64
+#endif
+
+/// Number of independent states spritz_encrypt_multi()/spritz_decrypt_multi()
+/// advance in lock-step. Each lane needs sizeof(spritz_state) bytes of stack.
+#ifndef SPRITZ_MULTI_LANES
+#define SPRITZ_MULTI_LANES 4
+#endif
+
+/// One message for spritz_encrypt_multi()/spritz_decrypt_multi().
+typedef struct spritz_lane_ {
+    unsigned char *out;
+    const unsigned char *in;
+    size_t len;
+    const unsigned char *nonce;
+    size_t noncelen;
+    const spritz_keyed_ctx *ctx;
+} spritz_lane;
+
+/// Encrypt/decrypt many independent messages at once (for example on a gateway
+/// that talks to many devices). Up to SPRITZ_MULTI_LANES spritz states are interleaved,
+/// so that the dependent loads of one stream overlap with the loads of the others.
+/// The result is identical to calling spritz_keyed_encrypt()/spritz_keyed_decrypt()
+/// for every lane.
+int spritz_encrypt_multi(const spritz_lane *lanes, size_t lane_count);
+
+int spritz_decrypt_multi(const spritz_lane *lanes, size_t lane_count);
+
 int spritz_auth(unsigned char *out, size_t outlen,
                 const unsigned char *msg, size_t msglen,
                 const unsigned char *key, size_t keylen);
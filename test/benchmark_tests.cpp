@@ -0,0 +1,306 @@
+/*******************************************************************************
+ * Copyright (c) 2016  MSc. David Graeff <david.graeff@web.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ */
+
+// Benchmarks are disabled by default, run them with:
+// boostrapWifiTests --gtest_also_run_disabled_tests --gtest_filter=Benchmark.*
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "bootstrapWifi.h"
+#include "prv_bootstrapWifi.h"
+#include "spritz.h"
+#include "scheduler.h"
+
+template<class F>
+static double measure_seconds(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+TEST(Benchmark, DISABLED_SpritzMultiLane) {
+    const unsigned packets = 512;
+    const unsigned packet_len = BST_NETWORK_PACKET_SIZE;
+    const unsigned rounds = 10;
+
+    std::vector<unsigned char> data(packets * packet_len, 0x55);
+    std::vector<unsigned char> nonces(packets * BST_NONCE_SIZE);
+    std::vector<spritz_lane> lanes(packets);
+
+    spritz_keyed_ctx ctx;
+    spritz_keyed_setup(&ctx, (const unsigned char*)"app_secret", 10);
+
+    for (unsigned p = 0; p < packets; ++p) {
+        for (unsigned i = 0; i < BST_NONCE_SIZE; ++i)
+            nonces[p*BST_NONCE_SIZE+i] = (unsigned char)(p*i);
+        lanes[p].out = &data[p*packet_len];
+        lanes[p].in = &data[p*packet_len];
+        lanes[p].len = packet_len;
+        lanes[p].nonce = &nonces[p*BST_NONCE_SIZE];
+        lanes[p].noncelen = BST_NONCE_SIZE;
+        lanes[p].ctx = &ctx;
+    }
+
+    double scalar = measure_seconds([&]() {
+        for (unsigned r = 0; r < rounds; ++r)
+            for (unsigned p = 0; p < packets; ++p)
+                spritz_keyed_decrypt(lanes[p].out, lanes[p].in, lanes[p].len,
+                                     lanes[p].nonce, lanes[p].noncelen, &ctx);
+    });
+
+    double multi = measure_seconds([&]() {
+        for (unsigned r = 0; r < rounds; ++r)
+            spritz_decrypt_multi(lanes.data(), packets);
+    });
+
+    const double bytes = (double)packets * packet_len * rounds;
+    printf("spritz scalar: %8.2f MB/s (%u packets/s)\n", bytes / scalar / 1e6, (unsigned)(packets * rounds / scalar));
+    printf("spritz %2d-lane: %8.2f MB/s (%u packets/s)\n", SPRITZ_MULTI_LANES, bytes / multi / 1e6, (unsigned)(packets * rounds / multi));
+}
+
+TEST(Benchmark, DISABLED_SpritzShuffle) {
+    // Short messages: the time is dominated by the shuffle before the first keystream byte.
+    const unsigned rounds = 20000;
+    unsigned char msg[16] = {0};
+    unsigned char nonce[BST_NONCE_SIZE] = {0};
+
+    spritz_keyed_ctx ctx;
+    spritz_keyed_setup(&ctx, (const unsigned char*)"app_secret", 10);
+
+    double t = measure_seconds([&]() {
+        for (unsigned r = 0; r < rounds; ++r) {
+            nonce[0] = (unsigned char)r;
+            spritz_keyed_encrypt(msg, msg, sizeof msg, nonce, sizeof nonce, &ctx);
+        }
+    });
+
+    printf("spritz shuffle: %8.2f us per 16 byte message\n", t / rounds * 1e6);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t read_cycles() { return __rdtsc(); }
+#else
+static uint64_t read_cycles() {
+    return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+}
+#endif
+
+TEST(Benchmark, DISABLED_SpritzKeystream) {
+    // Cycles per byte for encrypting a wifi list packet (on non-x86 the unit is ns).
+    const unsigned rounds = 2000;
+    const size_t len = BST_NETWORK_PACKET_SIZE - BST_ENCRYPTED_OFFSET;
+    std::vector<unsigned char> msg(len, 0x55);
+    unsigned char nonce[BST_NONCE_SIZE] = {0};
+
+    spritz_keyed_ctx ctx;
+    spritz_keyed_setup(&ctx, (const unsigned char*)"app_secret", 10);
+
+    spritz_state state;
+    uint64_t full = 0, stream = 0;
+    for (unsigned r = 0; r < rounds; ++r) {
+        nonce[0] = (unsigned char)r;
+        uint64_t start = read_cycles();
+        spritz_keyed_start(&state, nonce, sizeof nonce, &ctx);
+        spritz_encrypt_update(&state, msg.data(), msg.data(), 1); // includes the shuffle
+        uint64_t mid = read_cycles();
+        spritz_encrypt_update(&state, msg.data()+1, msg.data()+1, len-1);
+        uint64_t end = read_cycles();
+        full += end - start;
+        stream += end - mid;
+    }
+
+    printf("spritz packet encryption: %6.2f cycles/byte (with shuffle), %6.2f cycles/byte (keystream only)\n",
+           (double)full / rounds / len, (double)stream / rounds / (len-1));
+}
+
+TEST(Benchmark, DISABLED_CRC16) {
+    // Compare builds with different -DBST_CRC16_VARIANT values in CMAKE_C_FLAGS.
+    const unsigned rounds = 20000;
+    std::vector<unsigned char> msg(BST_NETWORK_PACKET_SIZE, 0x55);
+    unsigned sum = 0;
+
+    double t = measure_seconds([&]() {
+        for (unsigned r = 0; r < rounds; ++r) {
+            msg[0] = (unsigned char)r;
+            sum += bst_crc16(msg.data(), (uint16_t)msg.size()).crc[0];
+        }
+    });
+
+    printf("crc16: %8.2f MB/s (%u)\n", (double)msg.size() * rounds / t / 1e6, sum & 1);
+}
+
+static time_t bench_time;
+static void bench_network_output(void*, const char*, size_t) {}
+static bst_connect_state bench_get_connection_state(void*) { return BST_STATE_NO_CONNECTION; }
+static void bench_connect_to_wifi(void*, const char*, const char*) {}
+static void bench_connect_advanced(void*, const char*) {}
+static void bench_void(void*) {}
+static void bench_store(void*, char*, size_t) {}
+static time_t bench_get_system_time_ms(void*) { return bench_time; }
+static uint64_t bench_get_random(void*) { return 1; }
+
+TEST(Benchmark, DISABLED_Scheduler) {
+    // 10k simulated devices searching the bootstrap network for 10s in 10ms ticks
+    const unsigned devices = 10000;
+    const unsigned ticks = 1000;
+    static const bst_callbacks callbacks = {
+        bench_network_output, bench_get_connection_state, bench_connect_to_wifi, bench_connect_advanced,
+        bench_void, bench_void, bench_store, bench_store, bench_get_system_time_ms, bench_get_random
+    };
+
+    bst_connect_options o = {};
+    o.initial_crypto_secret = "app_secret";
+    o.initial_crypto_secret_len = sizeof("app_secret");
+    o.unique_device_id = "ABCDEF";
+    o.name = "bench";
+    o.bootstrap_ssid = "bootstrap_ssid";
+    o.bootstrap_key = "bootstrap_key";
+    o.timeout_connecting_state_ms = 10000;
+    o.timeout_nonce_ms = 60000;
+    o.connection_events = true;
+
+    std::vector<bst_ctx_t> ctxs(devices);
+    auto setup = [&]() {
+        bench_time = 1000;
+        for (bst_ctx_t& ctx : ctxs)
+            bst_ctx_setup(&ctx, &callbacks, nullptr, o, NULL, 0, NULL, 0);
+    };
+
+    setup();
+    double polling = measure_seconds([&]() {
+        for (unsigned t = 0; t < ticks; ++t) {
+            bench_time += BST_SCHEDULER_TICK_MS;
+            for (bst_ctx_t& ctx : ctxs)
+                bst_ctx_periodic(&ctx);
+        }
+    });
+
+    setup();
+    static bst_scheduler scheduler;
+    bst_scheduler_init(&scheduler, bench_time);
+    for (bst_ctx_t& ctx : ctxs)
+        bst_scheduler_add(&scheduler, &ctx);
+    size_t stepped = 0;
+    double wheel = measure_seconds([&]() {
+        for (unsigned t = 0; t < ticks; ++t) {
+            bench_time += BST_SCHEDULER_TICK_MS;
+            stepped += bst_scheduler_run(&scheduler, bench_time);
+        }
+    });
+
+    printf("polling: %8.2f us per tick, scheduler: %8.2f us per tick (%u steps)\n",
+           polling / ticks * 1e6, wheel / ticks * 1e6, (unsigned)stepped);
+}
+
+struct StormDevice {
+    bst_ctx_t ctx;
+    bool connected;
+    uint64_t random;
+};
+static time_t storm_ap_up_time;
+static std::vector<unsigned>* storm_attempts; // per 100ms bucket
+
+static bst_connect_state storm_get_connection_state(void* user) {
+    return static_cast<StormDevice*>(user)->connected ? BST_STATE_CONNECTED : BST_STATE_NO_CONNECTION;
+}
+static void storm_connect_to_wifi(void* user, const char* ssid, const char*) {
+    if (strcmp(ssid, "site") != 0)
+        return;
+    ++(*storm_attempts)[bench_time / 100];
+    static_cast<StormDevice*>(user)->connected = bench_time >= storm_ap_up_time;
+}
+static uint64_t storm_get_random(void* user) {
+    uint64_t& x = static_cast<StormDevice*>(user)->random;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+TEST(Benchmark, DISABLED_ReconnectStorm) {
+    // 300 devices lose their access point for 60s and reconnect
+    const unsigned devices = 300;
+    const time_t outage = 1000, recovery = 61000, end = 181000;
+    static const bst_callbacks callbacks = {
+        bench_network_output, storm_get_connection_state, storm_connect_to_wifi, bench_connect_advanced,
+        bench_void, bench_void, bench_store, bench_store, bench_get_system_time_ms, storm_get_random
+    };
+    static const char stored[] = "site\0pwd";
+
+    struct { const char* name; uint8_t backoff; int base; int cap; uint8_t jitter; } policies[] = {
+        {"fixed 10s", BST_BACKOFF_FIXED, 10000, 0, 0},
+        {"fixed 10s, 50% jitter", BST_BACKOFF_FIXED, 10000, 0, 50},
+        {"exponential 1s..30s, full jitter", BST_BACKOFF_EXPONENTIAL, 1000, 30000, 100},
+    };
+
+    for (auto& policy : policies) {
+        bst_connect_options o = {};
+        o.initial_crypto_secret = "app_secret";
+        o.initial_crypto_secret_len = sizeof("app_secret");
+        o.unique_device_id = "ABCDEF";
+        o.name = "bench";
+        o.bootstrap_ssid = "bootstrap_ssid";
+        o.bootstrap_key = "bootstrap_key";
+        o.timeout_connecting_state_ms = 10000;
+        o.timeout_nonce_ms = 60000;
+        o.retry_connecting_to_destination_network = 255;
+        o.reconnect_backoff = policy.backoff;
+        o.reconnect_backoff_base_ms = policy.base;
+        o.reconnect_backoff_cap_ms = policy.cap;
+        o.reconnect_jitter_percent = policy.jitter;
+
+        std::vector<unsigned> attempts(end / 100 + 1);
+        storm_attempts = &attempts;
+        storm_ap_up_time = 0;
+        bench_time = 0;
+
+        std::vector<StormDevice> ds(devices);
+        for (unsigned i = 0; i < devices; ++i) {
+            ds[i].random = 0x9e3779b97f4a7c15ull * (i+1);
+            bst_ctx_setup(&ds[i].ctx, &callbacks, &ds[i], o, stored, sizeof(stored), NULL, 0);
+        }
+
+        time_t all_connected = 0;
+        for (bench_time = 0; bench_time <= end; bench_time += 10) {
+            if (bench_time == outage) {
+                storm_ap_up_time = recovery;
+                for (StormDevice& d : ds)
+                    d.connected = false;
+            }
+            unsigned connected = 0;
+            for (StormDevice& d : ds) {
+                bst_ctx_periodic(&d.ctx);
+                connected += bst_ctx_get_state(&d.ctx) == BST_MODE_DESTINATION_CONNECTED;
+            }
+            if (bench_time > recovery && !all_connected && connected == devices)
+                all_connected = bench_time;
+        }
+
+        unsigned peak = 0, total = 0;
+        for (size_t b = outage / 100 + 1; b < attempts.size(); ++b) {
+            peak = std::max(peak, attempts[b]);
+            total += attempts[b];
+        }
+        printf("%-34s peak %3u attempts per 100ms, %5u attempts, all reconnected %5.1fs after recovery\n",
+               policy.name, peak, total, all_connected ? (all_connected - recovery) / 1000.0 : -1.0);
+    }
+}
@@ -17,6 +17,8 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <vector>
+
 #include "bootstrapWifi.h"
 #include "prv_bootstrapWifi.h"
 #include "test_platform_impl.h"
@@ -94,6 +96,60 @@ TEST_F(SetupTests, CRC16) {
     ASSERT_TRUE(v_zero == v);
 }
 
+static uint16_t crc16_bitwise_reference(const unsigned char *pData, size_t size) {
+    uint16_t wCrc = 0xffff;
+    while(size--) {
+        wCrc ^= *pData++ << 8;
+        for (int i=0; i < 8; i++)
+            wCrc = (wCrc & 0x8000) ? ((wCrc << 1) ^ 0x1021) : (wCrc << 1);
+    }
+    return wCrc;
+}
+
+TEST_F(SetupTests, CRC16LongBuffers) {
+    unsigned char data[BST_NETWORK_PACKET_SIZE+16];
+    for (size_t i=0; i < sizeof(data); ++i)
+        data[i] = (unsigned char)(i * 131 + 7);
+
+    // All lengths and a few misalignments to cover the slicing loop and the tail
+    for (size_t offset=0; offset < 3; ++offset) {
+        for (size_t len=0; len <= BST_NETWORK_PACKET_SIZE; ++len) {
+            uint16_t ref = crc16_bitwise_reference(data+offset, len);
+            bst_crc_value v = bst_crc16(data+offset, (uint16_t)len);
+            ASSERT_EQ(ref >> 8, v.crc[0]) << "len " << len;
+            ASSERT_EQ(ref & 0xff, v.crc[1]) << "len " << len;
+        }
+    }
+}
+
+TEST_F(SetupTests, CRC16Incremental) {
+    unsigned char data[BST_NETWORK_PACKET_SIZE];
+    for (size_t i=0; i < sizeof(data); ++i)
+        data[i] = (unsigned char)(i * 31 + 3);
+
+    const bst_crc_value expected = bst_crc16(data, sizeof(data));
+
+    // Fragments of different sizes, crossing the block sizes of all crc variants
+    const size_t fragment_sizes[] = {1, 2, 3, 7, 15, 16, 17, 63, 64, 65, 200};
+    for (size_t f=0; f < sizeof(fragment_sizes)/sizeof(fragment_sizes[0]); ++f) {
+        bst_crc16_ctx ctx;
+        bst_crc16_init(&ctx);
+        for (size_t pos=0; pos < sizeof(data); pos += fragment_sizes[f]) {
+            size_t len = sizeof(data)-pos < fragment_sizes[f] ? sizeof(data)-pos : fragment_sizes[f];
+            bst_crc16_update(&ctx, data+pos, len);
+        }
+        ASSERT_TRUE(expected == bst_crc16_final(&ctx)) << "fragment size " << fragment_sizes[f];
+    }
+
+    // Empty updates do not change anything
+    bst_crc16_ctx ctx;
+    bst_crc16_init(&ctx);
+    bst_crc16_update(&ctx, data, 0);
+    bst_crc16_update(&ctx, data, sizeof(data));
+    bst_crc16_update(&ctx, data, 0);
+    ASSERT_TRUE(expected == bst_crc16_final(&ctx));
+}
+
 TEST_F(SetupTests, CRC16withHello) {
     unsigned char data[] = {0x42 ,0x53 ,0x54 ,0x77 ,0x69 ,0x66 ,0x69 ,0x31 ,0xc5 ,0x86 ,0x01 ,0xa9 ,0x20 ,0xa9 ,0x38 ,0x1a ,0x31 ,0x9d ,0x32};
     bst_crc_value v, cmp = {222, 30};
@@ -122,18 +178,36 @@ TEST_F(SetupTests, EncryptDecrypt) {
 
     bst_udp_send_pkt_t p;
 
-    prv_add_header(&p);
+    prv_add_header(&prv_instance, (bst_udp_send_hdr_t*)&p);
     memcpy(p.device_nonce,"test",5);
-    prv_add_checksum_and_encrypt(&p, sizeof(bst_udp_send_pkt_t));
+    prv_add_checksum_and_encrypt(&prv_instance, (bst_udp_send_hdr_t*)&p, sizeof(bst_udp_send_pkt_t));
 
     bst_udp_hello_receive_pkt_t* pkt = (bst_udp_hello_receive_pkt_t*)&p;
-    ASSERT_TRUE(prv_check_header_and_decrypt((bst_udp_receive_pkt_t*)pkt,sizeof(bst_udp_send_pkt_t)));
+    ASSERT_TRUE(prv_check_header_and_decrypt(&prv_instance, (bst_udp_receive_pkt_t*)pkt,sizeof(bst_udp_send_pkt_t)));
 
     pkt->app_nonce[BST_NONCE_SIZE-1] = 0; // safety \0
 
     ASSERT_STREQ("test", pkt->app_nonce);
 }
 
+TEST_F(SetupTests, DecryptRejectsCorruptedPacket) {
+    bst_connect_options o = default_options();
+    bst_setup(o, NULL, 0, NULL, 0);
+
+    memset(prv_instance.state.prv_device_nonce, 'n', BST_NONCE_SIZE);
+    memset(prv_instance.state.prv_app_nonce, 'n', BST_NONCE_SIZE);
+
+    bst_udp_send_pkt_t p;
+    memset(&p, 0, sizeof(bst_udp_send_pkt_t));
+    prv_add_header(&prv_instance, (bst_udp_send_hdr_t*)&p);
+    memcpy(p.data_wifi_list_and_log_msg, "some content", sizeof("some content"));
+    prv_add_checksum_and_encrypt(&prv_instance, (bst_udp_send_hdr_t*)&p, sizeof(bst_udp_send_pkt_t));
+
+    // Flip a bit in the last encrypted byte
+    ((char*)&p)[sizeof(bst_udp_send_pkt_t)-1] ^= 1;
+    ASSERT_FALSE(prv_check_header_and_decrypt(&prv_instance, (bst_udp_receive_pkt_t*)&p,sizeof(bst_udp_send_pkt_t)));
+}
+
 TEST_F(SetupTests, EmptyOptions) {
     bst_setup({},NULL,0,NULL,0);
 }
@@ -197,3 +271,81 @@ TEST_F(SetupTests, OptionsWithStoredData) {
     ASSERT_EQ(sizeof("WLAN_SSID_NAME")+sizeof("WLAN_PWD")+additional_data_len, prv_instance.storage_len);
     ASSERT_STREQ(adv_data, prv_instance.additional);
 }
+
+// A simulated device for the context API
+struct SimulatedDevice {
+    bst_ctx_t ctx;
+    bst_connect_state connection;
+    time_t time;
+    std::vector<std::vector<char>> output;
+};
+
+static void sim_network_output(void* user, const char* data, size_t data_len) {
+    static_cast<SimulatedDevice*>(user)->output.push_back(std::vector<char>(data, data+data_len));
+}
+static bst_connect_state sim_get_connection_state(void* user) {
+    return static_cast<SimulatedDevice*>(user)->connection;
+}
+static void sim_connect_to_wifi(void*, const char*, const char*) {}
+static void sim_connect_advanced(void*, const char*) {}
+static void sim_connected_to_bootstrap_network(void*) {}
+static void sim_request_wifi_network_list(void* user) {
+    bst_ctx_wifi_network_list(&static_cast<SimulatedDevice*>(user)->ctx, nullptr);
+}
+static void sim_store_bootstrap_data(void*, char*, size_t) {}
+static void sim_store_crypto_secret(void*, char*, size_t) {}
+static time_t sim_get_system_time_ms(void* user) {
+    return static_cast<SimulatedDevice*>(user)->time;
+}
+static uint64_t sim_get_random(void*) {
+    return 42;
+}
+
+static const bst_callbacks sim_callbacks = {
+    sim_network_output, sim_get_connection_state, sim_connect_to_wifi, sim_connect_advanced,
+    sim_connected_to_bootstrap_network, sim_request_wifi_network_list, sim_store_bootstrap_data,
+    sim_store_crypto_secret, sim_get_system_time_ms, sim_get_random
+};
+
+TEST_F(SetupTests, IndependentContexts) {
+    ASSERT_EQ(sizeof(bst_ctx_t), bst_ctx_size());
+
+    bst_setup(default_options(), NULL, 0, NULL, 0);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+
+    static SimulatedDevice devices[3];
+    for (SimulatedDevice& d : devices) {
+        d.connection = BST_STATE_NO_CONNECTION;
+        d.time = 1000;
+        d.output.clear();
+        bst_ctx_setup(&d.ctx, &sim_callbacks, &d, default_options(), NULL, 0, NULL, 0);
+    }
+
+    // Only the second device finds the bootstrap network and sends a HELLO
+    devices[1].connection = BST_STATE_CONNECTED;
+    for (SimulatedDevice& d : devices)
+        bst_ctx_periodic(&d.ctx);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_ctx_get_state(&devices[0].ctx));
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_ctx_get_state(&devices[1].ctx));
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_ctx_get_state(&devices[2].ctx));
+    ASSERT_EQ(1u, devices[1].output.size());
+
+    // It answers an app with the wifi list
+    bst_udp_hello_receive_pkt_t hello;
+    memcpy(hello.app_nonce, "app_nonc", BST_NONCE_SIZE);
+    add_header_to_receive_pkt((bst_udp_receive_pkt_t*)&hello, CMD_HELLO);
+    add_checksum_to_receive_pkt((bst_udp_receive_pkt_t*)&hello, sizeof(hello));
+    bst_ctx_network_input(&devices[1].ctx, (const char*)&hello, sizeof(hello));
+    bst_ctx_periodic(&devices[1].ctx);
+    ASSERT_EQ(2u, devices[1].output.size());
+    ASSERT_EQ((size_t)BST_NETWORK_PACKET_SIZE, devices[1].output[1].size());
+    ASSERT_EQ(1u, bst_ctx_get_input_stats(&devices[1].ctx)->accepted);
+
+    ASSERT_EQ(0u, devices[0].output.size());
+    ASSERT_EQ(0u, devices[2].output.size());
+    ASSERT_EQ(0u, bst_ctx_get_input_stats(&devices[0].ctx)->accepted);
+
+    // The default context is not touched
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+    ASSERT_EQ(0u, bst_get_input_stats()->accepted);
+}
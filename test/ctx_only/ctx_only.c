@@ -0,0 +1,79 @@
+// Links the context API without the default context: None of the platform
+// functions of bootstrapWifi.h are implemented here.
+
+#include "bootstrapWifi.h"
+#include "prv_bootstrapWifi.h"
+#include <string.h>
+
+static time_t now_ms = 1000;
+static int connects = 0;
+
+static void prv_network_output(void* user, const char* data, size_t data_len)
+{
+    (void)user; (void)data; (void)data_len;
+}
+
+static bst_connect_state prv_get_connection_state(void* user)
+{
+    (void)user;
+    return BST_STATE_NO_CONNECTION;
+}
+
+static void prv_connect_to_wifi(void* user, const char* ssid, const char* pwd)
+{
+    (void)user; (void)ssid; (void)pwd;
+    ++connects;
+}
+
+static void prv_connect_advanced(void* user, const char* data)
+{
+    (void)user; (void)data;
+}
+
+static void prv_user_only(void* user)
+{
+    (void)user;
+}
+
+static void prv_store(void* user, char* data, size_t data_len)
+{
+    (void)user; (void)data; (void)data_len;
+}
+
+static time_t prv_get_system_time_ms(void* user)
+{
+    (void)user;
+    return now_ms;
+}
+
+static uint64_t prv_get_random(void* user)
+{
+    (void)user;
+    return 4;
+}
+
+static const bst_callbacks callbacks = {
+    prv_network_output, prv_get_connection_state, prv_connect_to_wifi, prv_connect_advanced,
+    prv_user_only, prv_user_only, prv_store, prv_store, prv_get_system_time_ms, prv_get_random,
+    NULL, NULL
+};
+
+int main(void)
+{
+    static bst_ctx_t ctx;
+    bst_connect_options o;
+    memset(&o, 0, sizeof(o));
+    o.name = "ctx_only";
+    o.unique_device_id = "ABCDEF";
+    o.initial_crypto_secret = "app_secret";
+    o.initial_crypto_secret_len = sizeof("app_secret");
+    o.bootstrap_ssid = "bootstrap_ssid";
+    o.bootstrap_key = "bootstrap_key";
+    o.timeout_connecting_state_ms = 10000;
+    o.timeout_nonce_ms = 60000;
+
+    bst_ctx_setup(&ctx, &callbacks, NULL, o, NULL, 0, NULL, 0);
+    bst_ctx_periodic(&ctx);
+    // Not bootstrapped: The bootstrap network is tried
+    return bst_ctx_get_state(&ctx) == BST_MODE_CONNECTING_TO_BOOTSTRAP && connects == 1 ? 0 : 1;
+}
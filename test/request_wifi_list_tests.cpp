@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <string>
 #include <vector>
 
 #include "bootstrapWifi.h"
@@ -34,15 +35,18 @@ public:
         instance = this;
         bst_request_wifi_network_list_flag = false;
         output_data.clear();
+        output_packets.clear();
     }
 
     bool bst_request_wifi_network_list_flag;
     std::vector<char> output_data;
+    std::vector<std::vector<char>> output_packets;
 
     // bst_platform interface
 public:
     void bst_network_output(const char *data, size_t data_len) override {
         output_data = std::vector<char>(data, data+data_len);
+        output_packets.push_back(output_data);
     }
     bst_connect_state bst_get_connection_state() override {
         return BST_STATE_CONNECTED;
@@ -70,8 +74,7 @@ public:
 };
 
 static void prv_generate_test_hello(bst_udp_hello_receive_pkt_t* p) {
-    int len = sizeof("app_nonce");
-    memcpy(p->app_nonce,"app_nonce",len);
+    memcpy(p->app_nonce,"app_nonc",BST_NONCE_SIZE);
 
     RequestWifiListTests::add_header_to_receive_pkt((bst_udp_receive_pkt_t*)p, CMD_HELLO);
     RequestWifiListTests::add_checksum_to_receive_pkt((bst_udp_receive_pkt_t*)p, sizeof(bst_udp_hello_receive_pkt_t));
@@ -194,3 +197,389 @@ TEST_F(RequestWifiListTests, RequestList) {
 
     ASSERT_STREQ("wifi2", p);
 }
+
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+TEST_F(RequestWifiListTests, PrecomputedKeystream) {
+    bst_setup(default_options(), NULL, 0, NULL, 0);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+
+    { // Send hello packet now
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+
+    bst_periodic();
+    ASSERT_TRUE(bst_request_wifi_network_list_flag);
+
+    // Answer with a partially precomputed keystream
+    bst_periodic();
+    ASSERT_TRUE(prv_instance.keystream.started);
+    ASSERT_LT(prv_instance.keystream.len, sizeof(prv_instance.keystream.data));
+    bst_wifi_network_list(nullptr);
+    ASSERT_EQ((size_t)BST_NETWORK_PACKET_SIZE, output_data.size());
+    ASSERT_TRUE(check_send_header_and_decrypt((bst_udp_send_pkt_t*)output_data.data()));
+
+    // Answer with the complete precomputed keystream
+    for (int i=0; i < 20; ++i)
+        bst_periodic();
+    ASSERT_EQ(sizeof(prv_instance.keystream.data), prv_instance.keystream.len);
+    output_data.clear();
+    bst_wifi_network_list(nullptr);
+    ASSERT_EQ((size_t)BST_NETWORK_PACKET_SIZE, output_data.size());
+    ASSERT_TRUE(check_send_header_and_decrypt((bst_udp_send_pkt_t*)output_data.data()));
+}
+#endif
+
+TEST_F(RequestWifiListTests, SizeBuckets) {
+    bst_connect_options options = default_options();
+    options.wifi_list_size_buckets = true;
+    bst_setup(options, NULL, 0, NULL, 0);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+
+    { // Send hello packet now
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+    ASSERT_TRUE(bst_request_wifi_network_list_flag);
+
+    // Two short entries fit into the smallest bucket
+    bst_wifi_list_entry_t entries[12];
+    const char* ssids[12] = {"wifi1", "wifi2", "a_rather_long_network_name_01", "a_rather_long_network_name_02",
+                             "a_rather_long_network_name_03", "a_rather_long_network_name_04",
+                             "a_rather_long_network_name_05", "a_rather_long_network_name_06",
+                             "a_rather_long_network_name_07", "a_rather_long_network_name_08",
+                             "a_rather_long_network_name_09", "a_rather_long_network_name_10"};
+    for (int i=0; i < 12; ++i) {
+        entries[i].ssid = ssids[i];
+        entries[i].strength_percent = 50;
+        entries[i].encryption_mode = 2;
+        entries[i].next = i < 11 ? &entries[i+1] : nullptr;
+    }
+    entries[1].next = nullptr;
+
+    bst_wifi_network_list(entries);
+    ASSERT_EQ((size_t)128, output_data.size());
+    bst_udp_send_pkt_t pkt;
+    memcpy(&pkt, output_data.data(), output_data.size());
+    ASSERT_TRUE(check_send_header_and_decrypt(&pkt, output_data.size()));
+    ASSERT_EQ(2, pkt.wifi_list_entries);
+    ASSERT_STREQ(prv_instance.options.name, pkt.data_wifi_list_and_log_msg + pkt.wifi_list_size_in_bytes);
+
+    // All entries need the full packet
+    entries[1].next = &entries[2];
+    bst_wifi_network_list(entries);
+    ASSERT_EQ((size_t)BST_NETWORK_PACKET_SIZE, output_data.size());
+    memcpy(&pkt, output_data.data(), output_data.size());
+    ASSERT_TRUE(check_send_header_and_decrypt(&pkt, output_data.size()));
+    ASSERT_EQ(12, pkt.wifi_list_entries);
+
+    // Two short and six long entries fit into the second bucket
+    entries[7].next = nullptr;
+    bst_wifi_network_list(entries);
+    ASSERT_EQ((size_t)256, output_data.size());
+    memcpy(&pkt, output_data.data(), output_data.size());
+    ASSERT_TRUE(check_send_header_and_decrypt(&pkt, output_data.size()));
+    ASSERT_EQ(8, pkt.wifi_list_entries);
+}
+
+#if defined(BST_TRACE) && defined(BST_TRACE_IN_WIFI_LIST)
+TEST_F(RequestWifiListTests, TraceInPadding) {
+    bst_connect_options options = default_options();
+    options.wifi_list_size_buckets = true;
+    bst_setup(options, NULL, 0, NULL, 0);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+
+    { // Send hello packet now
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+    ASSERT_TRUE(bst_request_wifi_network_list_flag);
+
+    // The trace does not change the bucket
+    bst_wifi_list_entry_t entry = {"wifi1", 50, 2, nullptr};
+    bst_wifi_network_list(&entry);
+    ASSERT_EQ((size_t)128, output_data.size());
+    bst_udp_send_pkt_t pkt;
+    memcpy(&pkt, output_data.data(), output_data.size());
+    ASSERT_TRUE(check_send_header_and_decrypt(&pkt, output_data.size()));
+    ASSERT_EQ(1, pkt.wifi_list_entries);
+    ASSERT_STREQ(prv_instance.options.name, pkt.data_wifi_list_and_log_msg + pkt.wifi_list_size_in_bytes);
+
+    // The trace fills the padding after the log message: Mode changes, connection attempt, hello
+    const char* trace = pkt.data_wifi_list_and_log_msg + pkt.wifi_list_size_in_bytes + strlen(prv_instance.options.name) + 1;
+    ASSERT_EQ(4, trace[0]);
+    ASSERT_EQ(BST_TRACE_STATE, trace[1+4]);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, trace[1+5]);
+    ASSERT_EQ(BST_TRACE_PACKET_ACCEPTED, trace[1+3*6+4]);
+    ASSERT_EQ(CMD_HELLO, trace[1+3*6+5]);
+}
+#endif
+
+/// Decrypt a page of a paginated wifi list: Page n uses the keystream after the one of page n-1.
+static bool prv_decrypt_page(bst_udp_send_paged_pkt_t* pkt, size_t pkt_len, unsigned page) {
+    const size_t offset = sizeof(bst_udp_receive_pkt_t);
+    const size_t full_len = sizeof(bst_udp_send_paged_pkt_t) - offset;
+    unsigned char* out_in = (unsigned char*)pkt+offset;
+
+    spritz_keyed_ctx ctx;
+    spritz_keyed_setup(&ctx, (const unsigned char*)prv_instance.crypto_secret, prv_instance.crypto_secret_len);
+    spritz_state state;
+    spritz_keyed_start(&state, (const unsigned char*)prv_instance.state.prv_app_nonce, BST_NONCE_SIZE, &ctx);
+    std::vector<unsigned char> skip(full_len * page + 1);
+    spritz_squeeze(&state, skip.data(), full_len * page);
+    spritz_decrypt_update(&state, out_in, out_in, pkt_len-offset);
+
+    bst_crc_value v = bst_crc16(out_in, pkt_len-offset);
+    return memcmp(&v, &pkt->crc, sizeof(bst_crc_value)) == 0;
+}
+
+TEST_F(RequestWifiListTests, PaginatedList) {
+    bst_setup(default_options(), NULL, 0, NULL, 0);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+
+    { // Send a hello packet with protocol version 2
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        pkt.hdr[BST_NETWORK_HEADER_SIZE-1] = '2';
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+    ASSERT_TRUE(bst_request_wifi_network_list_flag);
+    ASSERT_EQ(2, prv_instance.state.protocol_version);
+
+    // 40 entries with 30 byte ssids need three pages
+    const unsigned count = 40;
+    std::vector<bst_wifi_list_entry_t> entries(count);
+    std::vector<std::string> ssids(count);
+    for (unsigned i=0; i < count; ++i) {
+        char name[40];
+        snprintf(name, sizeof(name), "a_rather_long_network_name_%03u", i);
+        ssids[i] = name;
+        entries[i].ssid = ssids[i].c_str();
+        entries[i].strength_percent = (uint8_t)i;
+        entries[i].encryption_mode = 2;
+        entries[i].next = i+1 < count ? &entries[i+1] : nullptr;
+    }
+
+    output_packets.clear();
+    bst_wifi_network_list(entries.data());
+    ASSERT_EQ(3u, output_packets.size());
+
+    unsigned received = 0;
+    for (unsigned page=0; page < output_packets.size(); ++page) {
+        bst_udp_send_paged_pkt_t pkt;
+        ASSERT_EQ(sizeof(pkt), output_packets[page].size());
+        memcpy(&pkt, output_packets[page].data(), sizeof(pkt));
+        ASSERT_EQ('2', pkt.hdr[BST_NETWORK_HEADER_SIZE-1]);
+        ASSERT_TRUE(prv_decrypt_page(&pkt, sizeof(pkt), page));
+        ASSERT_EQ(page, pkt.page);
+        ASSERT_EQ(3, pkt.page_count);
+
+        const char* p = pkt.data_wifi_list_and_log_msg;
+        for (unsigned i=0; i < pkt.wifi_list_entries; ++i, ++received) {
+            ASSERT_EQ(received, (uint8_t)p[0]);
+            ASSERT_STREQ(ssids[received].c_str(), p+2);
+            p += 2 + ssids[received].size() + 1;
+        }
+        const size_t list_size = (size_t)pkt.wifi_list_size_in_bytes[0] << 8 | pkt.wifi_list_size_in_bytes[1];
+        ASSERT_EQ(list_size, (size_t)(p - pkt.data_wifi_list_and_log_msg));
+        ASSERT_STREQ(prv_instance.options.name, p);
+    }
+    ASSERT_EQ(count, received);
+}
+
+TEST_F(RequestWifiListTests, CompactSortedList) {
+    bst_setup(default_options(), NULL, 0, NULL, 0);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+
+    { // Send a hello packet with protocol version 3
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        pkt.hdr[BST_NETWORK_HEADER_SIZE-1] = '3';
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+    ASSERT_EQ(3, prv_instance.state.protocol_version);
+
+    // One ssid per BSSID, in scan order
+    struct { const char* ssid; uint8_t strength; uint8_t enc; } scan[] = {
+        {"wifi_a", 20, 2}, {"wifi_b", 80, 1}, {"bootstrap_ssid", 100, 2}, {"wifi_a", 60, 2},
+        {"wifi_c", 80, 0}, {"wifi_b", 40, 1}, {"wifi_d", 100, 2}
+    };
+    const unsigned count = sizeof(scan)/sizeof(scan[0]);
+    bst_wifi_list_entry_t entries[count];
+    for (unsigned i=0; i < count; ++i) {
+        entries[i].ssid = scan[i].ssid;
+        entries[i].strength_percent = scan[i].strength;
+        entries[i].encryption_mode = scan[i].enc;
+        entries[i].next = i+1 < count ? &entries[i+1] : nullptr;
+    }
+
+    output_packets.clear();
+    bst_wifi_network_list(entries);
+    ASSERT_EQ(1u, output_packets.size());
+
+    bst_udp_send_paged_pkt_t pkt;
+    memcpy(&pkt, output_packets[0].data(), sizeof(pkt));
+    ASSERT_EQ('3', pkt.hdr[BST_NETWORK_HEADER_SIZE-1]);
+    ASSERT_TRUE(prv_decrypt_page(&pkt, sizeof(pkt), 0));
+    ASSERT_EQ(4, pkt.wifi_list_entries);
+
+    // Strongest first, equal strength in scan order, strongest BSSID per ssid
+    struct { const char* ssid; uint8_t strength; uint8_t enc; } expected[] = {
+        {"wifi_d", 100, 2}, {"wifi_b", 80, 1}, {"wifi_c", 80, 0}, {"wifi_a", 60, 2}
+    };
+    const char* p = pkt.data_wifi_list_and_log_msg;
+    for (unsigned i=0; i < 4; ++i) {
+        ASSERT_EQ(expected[i].strength/2, (uint8_t)p[0] >> 2);
+        ASSERT_EQ(expected[i].enc, (uint8_t)p[0] & 0x3);
+        ASSERT_STREQ(expected[i].ssid, p+1);
+        p += 1 + strlen(expected[i].ssid) + 1;
+    }
+    const size_t list_size = (size_t)pkt.wifi_list_size_in_bytes[0] << 8 | pkt.wifi_list_size_in_bytes[1];
+    ASSERT_EQ(list_size, (size_t)(p - pkt.data_wifi_list_and_log_msg));
+    ASSERT_STREQ(prv_instance.options.name, p);
+}
+
+TEST_F(RequestWifiListTests, CompactListKeepsStrongest) {
+    bst_setup(default_options(), NULL, 0, NULL, 0);
+    bst_periodic();
+    {
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        pkt.hdr[BST_NETWORK_HEADER_SIZE-1] = '3';
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+
+    // More different ssids than BST_WIFI_LIST_MAX_ENTRIES, getting stronger
+    const unsigned count = BST_WIFI_LIST_MAX_ENTRIES + 8;
+    std::vector<bst_wifi_list_entry_t> entries(count);
+    std::vector<std::string> ssids(count);
+    for (unsigned i=0; i < count; ++i) {
+        ssids[i] = "net" + std::to_string(i);
+        entries[i].ssid = ssids[i].c_str();
+        entries[i].strength_percent = (uint8_t)i;
+        entries[i].encryption_mode = 0;
+        entries[i].next = i+1 < count ? &entries[i+1] : nullptr;
+    }
+
+    output_packets.clear();
+    bst_wifi_network_list(entries.data());
+    ASSERT_EQ(1u, output_packets.size());
+
+    bst_udp_send_paged_pkt_t pkt;
+    memcpy(&pkt, output_packets[0].data(), sizeof(pkt));
+    ASSERT_TRUE(prv_decrypt_page(&pkt, sizeof(pkt), 0));
+    ASSERT_EQ(BST_WIFI_LIST_MAX_ENTRIES, pkt.wifi_list_entries);
+    ASSERT_STREQ(ssids[count-1].c_str(), pkt.data_wifi_list_and_log_msg+1);
+}
+
+#ifdef BST_WIFI_SCAN_CACHE
+TEST_F(RequestWifiListTests, ScanCache) {
+    overwrite_time = 100000;
+    bst_connect_options options = default_options();
+    options.wifi_scan_cache_ttl_ms = 60000;
+    bst_setup(options, NULL, 0, NULL, 0);
+
+    // Entering the waiting state does not scan
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    ASSERT_FALSE(bst_request_wifi_network_list_flag);
+    output_packets.clear();
+
+    { // Send hello packet now, the app waits for a scan
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+    ASSERT_TRUE(bst_request_wifi_network_list_flag);
+    bst_request_wifi_network_list_flag = false;
+
+    bst_wifi_list_entry_t p2 = {"wifi2", 50, 2, nullptr};
+    bst_wifi_list_entry_t p1 = {"wifi1", 100, 2, &p2};
+    {
+        // The ssids are copied into the cache
+        char ssid[] = "wifi3";
+        bst_wifi_list_entry_t p3 = {ssid, 30, 1, &p1};
+        bst_wifi_network_list(&p3);
+        ssid[0] = 'x';
+    }
+    // The waiting app gets the scan as reported
+    ASSERT_EQ(1u, output_packets.size());
+    bst_udp_send_pkt_t* pkt = (bst_udp_send_pkt_t*)output_data.data();
+    ASSERT_TRUE(check_send_header_and_decrypt(pkt));
+    ASSERT_EQ(3, pkt->wifi_list_entries);
+    ASSERT_STREQ("wifi3", pkt->data_wifi_list_and_log_msg+2);
+    ASSERT_STREQ("wifi1", pkt->data_wifi_list_and_log_msg+2+6+2);
+    output_packets.clear();
+
+    { // Same app, same session: It is answered from the cache
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+    ASSERT_FALSE(bst_request_wifi_network_list_flag);
+    ASSERT_EQ(1u, output_packets.size());
+
+    pkt = (bst_udp_send_pkt_t*)output_data.data();
+    ASSERT_TRUE(check_send_header_and_decrypt(pkt));
+    ASSERT_EQ(3, pkt->wifi_list_entries);
+    // The cache keeps the strongest first
+    ASSERT_STREQ("wifi1", pkt->data_wifi_list_and_log_msg+2);
+    ASSERT_STREQ("wifi2", pkt->data_wifi_list_and_log_msg+2+6+2);
+    ASSERT_STREQ("wifi3", pkt->data_wifi_list_and_log_msg+2+6+2+6+2);
+
+    // Not refreshed in the background during the app session
+    overwrite_time += 30000;
+    bst_periodic();
+    ASSERT_FALSE(bst_request_wifi_network_list_flag);
+
+    // Refreshed after the app session, a limited number of times
+    overwrite_time = prv_instance.state.time_nonce_valid;
+    for (int i = 0; i < BST_WIFI_SCAN_CACHE_REFRESHES; ++i) {
+        overwrite_time += 1;
+        ASSERT_EQ(bst_get_system_time_ms(), bst_next_wakeup_ms());
+        bst_periodic();
+        ASSERT_TRUE(bst_request_wifi_network_list_flag);
+        bst_request_wifi_network_list_flag = false;
+        bst_wifi_network_list(&p1);
+        overwrite_time += options.wifi_scan_cache_ttl_ms/2;
+    }
+    bst_periodic();
+    ASSERT_FALSE(bst_request_wifi_network_list_flag);
+    ASSERT_EQ(1u, output_packets.size());
+
+    // An expired cache is not used, the app has to wait for a new scan
+    overwrite_time += options.wifi_scan_cache_ttl_ms;
+    output_packets.clear();
+    bst_wifi_list_entry_t p4 = {"wifi4", 10, 0, nullptr};
+    {
+        bst_udp_hello_receive_pkt_t hello;
+        prv_generate_test_hello(&hello);
+        bst_network_input((char*)&hello,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    bst_periodic();
+    ASSERT_TRUE(bst_request_wifi_network_list_flag);
+    ASSERT_EQ(0u, output_packets.size());
+
+    bst_wifi_network_list(&p4);
+    ASSERT_EQ(1u, output_packets.size());
+    pkt = (bst_udp_send_pkt_t*)output_data.data();
+    ASSERT_TRUE(check_send_header_and_decrypt(pkt));
+    ASSERT_EQ(1, pkt->wifi_list_entries);
+    ASSERT_STREQ("wifi4", pkt->data_wifi_list_and_log_msg+2);
+}
+#endif
@@ -0,0 +1,181 @@
+/*******************************************************************************
+ * Copyright (c) 2016  MSc. David Graeff <david.graeff@web.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "bootstrapWifi.h"
+#include "prv_bootstrapWifi.h"
+#include "scheduler.h"
+#include "test_platform_impl.h"
+
+static time_t scheduler_test_time;
+
+struct ScheduledDevice {
+    bst_ctx_t ctx;
+    bst_connect_state connection;
+    unsigned connect_attempts;
+};
+
+static void sched_network_output(void*, const char*, size_t) {}
+static bst_connect_state sched_get_connection_state(void* user) {
+    return static_cast<ScheduledDevice*>(user)->connection;
+}
+// A connection attempt of sched_wake_from wakes sched_wake_to up
+static bst_scheduler* sched_scheduler;
+static ScheduledDevice* sched_wake_from;
+static ScheduledDevice* sched_wake_to;
+
+static void sched_connect_to_wifi(void* user, const char*, const char*) {
+    ++static_cast<ScheduledDevice*>(user)->connect_attempts;
+    if (user == sched_wake_from)
+        bst_scheduler_wake(sched_scheduler, &sched_wake_to->ctx);
+}
+static void sched_connect_advanced(void*, const char*) {}
+static void sched_connected_to_bootstrap_network(void*) {}
+static void sched_request_wifi_network_list(void*) {}
+static void sched_store_bootstrap_data(void*, char*, size_t) {}
+static void sched_store_crypto_secret(void*, char*, size_t) {}
+static time_t sched_get_system_time_ms(void*) {
+    return scheduler_test_time;
+}
+static uint64_t sched_get_random(void*) {
+    return 7;
+}
+
+static const bst_callbacks sched_callbacks = {
+    sched_network_output, sched_get_connection_state, sched_connect_to_wifi, sched_connect_advanced,
+    sched_connected_to_bootstrap_network, sched_request_wifi_network_list, sched_store_bootstrap_data,
+    sched_store_crypto_secret, sched_get_system_time_ms, sched_get_random
+};
+
+TEST(SchedulerTests, OnlyExpiredContextsAreStepped) {
+    const unsigned count = 100;
+    std::vector<ScheduledDevice> devices(count);
+    bst_scheduler scheduler;
+
+    scheduler_test_time = 100000;
+    bst_scheduler_init(&scheduler, scheduler_test_time);
+
+    bst_connect_options o = bst_platform::default_options();
+    o.connection_events = true;
+    for (ScheduledDevice& d : devices) {
+        d.connection = BST_STATE_NO_CONNECTION;
+        d.connect_attempts = 0;
+        bst_ctx_setup(&d.ctx, &sched_callbacks, &d, o, NULL, 0, NULL, 0);
+        bst_scheduler_add(&scheduler, &d.ctx);
+    }
+    ASSERT_EQ(1u, devices[0].connect_attempts);
+
+    // Nothing to do until the next connection attempt
+    scheduler_test_time += BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(0u, bst_scheduler_run(&scheduler, scheduler_test_time));
+
+    // An event only steps its context
+    devices[5].connection = BST_STATE_CONNECTED;
+    bst_ctx_connection_event(&devices[5].ctx, BST_STATE_CONNECTED);
+    bst_scheduler_wake(&scheduler, &devices[5].ctx);
+    scheduler_test_time += BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(1u, bst_scheduler_run(&scheduler, scheduler_test_time));
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_ctx_get_state(&devices[5].ctx));
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_ctx_get_state(&devices[4].ctx));
+
+    bst_scheduler_remove(&devices[0].ctx);
+    // A removed context can be removed again
+    bst_scheduler_remove(&devices[0].ctx);
+
+    // The connection timeout expires for everyone else
+    scheduler_test_time = 100000 + o.timeout_connecting_state_ms - BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(0u, bst_scheduler_run(&scheduler, scheduler_test_time));
+    scheduler_test_time += BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(count-1, bst_scheduler_run(&scheduler, scheduler_test_time));
+    ASSERT_EQ(1u, devices[0].connect_attempts);
+    ASSERT_EQ(2u, devices[1].connect_attempts);
+
+    scheduler_test_time += BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(0u, bst_scheduler_run(&scheduler, scheduler_test_time));
+
+    // A pause longer than the wheel steps every context only once
+    scheduler_test_time += BST_SCHEDULER_SLOTS*BST_SCHEDULER_TICK_MS*3;
+    ASSERT_EQ(count-1, bst_scheduler_run(&scheduler, scheduler_test_time));
+    ASSERT_EQ(3u, devices[1].connect_attempts);
+}
+
+TEST(SchedulerTests, FactoryResetKeepsTheContextScheduled) {
+    ScheduledDevice devices[2];
+    bst_scheduler scheduler;
+
+    scheduler_test_time = 5000;
+    bst_scheduler_init(&scheduler, scheduler_test_time);
+
+    bst_connect_options o = bst_platform::default_options();
+    o.connection_events = true;
+    for (ScheduledDevice& d : devices) {
+        d.connection = BST_STATE_NO_CONNECTION;
+        d.connect_attempts = 0;
+        bst_ctx_setup(&d.ctx, &sched_callbacks, &d, o, NULL, 0, NULL, 0);
+        bst_scheduler_add(&scheduler, &d.ctx);
+    }
+
+    bst_ctx_factory_reset(&devices[0].ctx);
+    bst_scheduler_wake(&scheduler, &devices[0].ctx);
+    scheduler_test_time += BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(1u, bst_scheduler_run(&scheduler, scheduler_test_time));
+    ASSERT_EQ(2u, devices[0].connect_attempts);
+
+    // Both are still in the wheel
+    scheduler_test_time += o.timeout_connecting_state_ms + BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(2u, bst_scheduler_run(&scheduler, scheduler_test_time));
+}
+
+TEST(SchedulerTests, CallbackWakesAnotherExpiredContext) {
+    ScheduledDevice devices[3];
+    bst_scheduler scheduler;
+
+    scheduler_test_time = 5000;
+    bst_scheduler_init(&scheduler, scheduler_test_time);
+
+    bst_connect_options o = bst_platform::default_options();
+    o.connection_events = true;
+    for (ScheduledDevice& d : devices) {
+        d.connection = BST_STATE_NO_CONNECTION;
+        d.connect_attempts = 0;
+        bst_ctx_setup(&d.ctx, &sched_callbacks, &d, o, NULL, 0, NULL, 0);
+        bst_scheduler_add(&scheduler, &d.ctx);
+    }
+
+    // All connection timeouts expire in the same tick. The first stepped context
+    // wakes up the second one, which is moved to the next tick.
+    sched_scheduler = &scheduler;
+    sched_wake_from = &devices[0];
+    sched_wake_to = &devices[1];
+    scheduler_test_time += o.timeout_connecting_state_ms + BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(2u, bst_scheduler_run(&scheduler, scheduler_test_time));
+    sched_wake_from = NULL;
+    ASSERT_EQ(2u, devices[0].connect_attempts);
+    ASSERT_EQ(1u, devices[1].connect_attempts);
+    ASSERT_EQ(2u, devices[2].connect_attempts);
+
+    scheduler_test_time += BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(1u, bst_scheduler_run(&scheduler, scheduler_test_time));
+    ASSERT_EQ(2u, devices[1].connect_attempts);
+
+    // Every context is still in the wheel
+    scheduler_test_time += o.timeout_connecting_state_ms + BST_SCHEDULER_TICK_MS;
+    ASSERT_EQ(3u, bst_scheduler_run(&scheduler, scheduler_test_time));
+}
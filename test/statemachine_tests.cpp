@@ -36,6 +36,12 @@ public:
         retry_advanced_connection = 0;
         next_connect_state = BST_STATE_NO_CONNECTION;
         connected_confirmed = false;
+        hint_works = true;
+        hinted_connects = 0;
+        stored_data_len = 0;
+        bootstrap_visible = true;
+        probes = 0;
+        probe_channel_hint = 0;
 
         bst_connect_options o = default_options();
         bst_setup(o,NULL, 0, NULL, 0);
@@ -55,6 +61,13 @@ public:
     int retry_advanced_connection;
     bst_state m_state;
     bst_connect_state next_connect_state;
+    bool hint_works;
+    int hinted_connects;
+    char stored_data[BST_STORAGE_RAM_SIZE];
+    size_t stored_data_len;
+    bool bootstrap_visible;
+    int probes;
+    uint8_t probe_channel_hint;
 
 
 public:
@@ -93,6 +106,23 @@ public:
                 next_connect_state = BST_STATE_FAILED_CREDENTIALS_WRONG;
         }
     }
+    void bst_connect_to_wifi_hinted(const char *ssid, const char *pwd, const bst_connect_hint* hint) override {
+        ++hinted_connects;
+        ASSERT_EQ(6, hint->channel);
+        if (hint_works)
+            bst_connect_to_wifi(ssid, pwd);
+        else
+            next_connect_state = BST_STATE_FAILED_SSID_NOT_FOUND;
+    }
+    void bst_discover_bootstrap_network(const char *ssid, uint8_t channel_hint) override {
+        ASSERT_STREQ("bootstrap_ssid", ssid);
+        ++probes;
+        probe_channel_hint = channel_hint;
+        if (bootstrap_visible)
+            bst_bootstrap_network_found(6);
+        else
+            bst_bootstrap_network_not_found();
+    }
     void bst_connect_advanced(const char *data) override {
         ASSERT_TRUE(data);
         size_t data_len = strlen(data);
@@ -109,8 +139,8 @@ public:
     }
 
     void bst_store_bootstrap_data(char *data, size_t data_len) override {
-        (void)data;
-        (void)data_len;
+        memcpy(stored_data, data, data_len);
+        stored_data_len = data_len;
     }
     void bst_store_crypto_secret(char *data, size_t data_len) override {
         (void)data;
@@ -148,8 +178,7 @@ static void prv_generate_test_hello(bst_udp_hello_receive_pkt_t* p) {
     const size_t pkt_len = sizeof(bst_udp_hello_receive_pkt_t);
     bst_platform::add_header_to_receive_pkt((bst_udp_receive_pkt_t*)p, CMD_HELLO);
 
-    int len = sizeof("app_nonce");
-    memcpy(p->app_nonce,"app_nonce",len);
+    memcpy(p->app_nonce,"app_nonc",BST_NONCE_SIZE);
 
     bst_platform::add_checksum_to_receive_pkt((bst_udp_receive_pkt_t*)p, pkt_len);
 }
@@ -212,6 +241,10 @@ TEST_F(StateMachineTests, Binding) {
         bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
     }
 
+    // The packet is processed and answered in the next run.
+    network_output_flag = NET_OUT_UNDEFINED;
+    bst_periodic();
+
     // Check if the device nonce has been applied correctly from bst_get_random().
     uint64_t nonce = *((uint64_t*)prv_instance.state.prv_device_nonce);
     ASSERT_EQ(bst_get_random(), nonce);
@@ -219,8 +252,6 @@ TEST_F(StateMachineTests, Binding) {
     // Check if the nonce is valid
     ASSERT_GE(prv_instance.state.time_nonce_valid, bst_get_system_time_ms());
 
-    network_output_flag = NET_OUT_UNDEFINED;
-    for (uint8_t i = 0; i<5;++i) bst_periodic();
     ASSERT_EQ(STATE_OK, network_out_state);
     ASSERT_EQ(NET_OUT_WIFI_LIST, network_output_flag);
     network_output_flag = NET_OUT_UNDEFINED;
@@ -231,7 +262,7 @@ TEST_F(StateMachineTests, Binding) {
         bst_network_input((char*)&pkt,sizeof(bst_udp_bind_receive_pkt_t));
     }
 
-    ASSERT_TRUE(prv_instance.flags.request_bind);
+    ASSERT_EQ(NET_OUT_UNDEFINED, network_output_flag);
     bst_periodic();
     ASSERT_EQ(NET_OUT_WIFI_LIST, network_output_flag);
     ASSERT_FALSE(prv_instance.flags.request_bind);
@@ -260,15 +291,16 @@ TEST_F(StateMachineTests, DataViaInputAndTimeoutAndReconnect) {
         bst_network_input((char*)&pkt,sizeof(bst_udp_bootstrap_receive_pkt_t));
     }
 
+    // In the next periodic run, the input is parsed, we shift from bootstrapping mode
+    // to BST_MODE_CONNECTING_TO_DEST and establish a connection.
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bst_periodic();
+
     // Test if input is parsed correctly
     ASSERT_STREQ("wifi1",prv_instance.ssid);
     ASSERT_STREQ("pwd",prv_instance.pwd);
     ASSERT_STREQ("test",prv_instance.additional);
 
-    // In the next periodic run, we shift from bootstrapping mode
-    // to BST_MODE_CONNECTING_TO_DEST and establish a connection.
-    next_connect_state = BST_STATE_NO_CONNECTION;
-    bst_periodic();
     ASSERT_EQ(NET_OUT_BOOTSTRAP_OK, network_output_flag);
     ASSERT_EQ(BST_STATE_CONNECTED, next_connect_state);
     ASSERT_EQ(BST_MODE_CONNECTING_TO_DEST, bst_get_state());
@@ -394,13 +426,14 @@ TEST_F(StateMachineTests, SendCredentialsWrong) {
         bst_network_input((char*)&pkt,sizeof(bst_udp_bootstrap_receive_pkt_t));
     }
 
+    // Parse the input and try to connect in the next run
+    bst_periodic();
+
     // Test if input is parsed correctly
     ASSERT_STREQ("wifi1",prv_instance.ssid);
     ASSERT_STREQ("pwdwrong",prv_instance.pwd);
     ASSERT_STREQ("test",prv_instance.additional);
 
-    // Try to connect in the next run
-    bst_periodic();
     ASSERT_EQ(BST_STATE_FAILED_CREDENTIALS_WRONG, bst_get_connection_state());
 
     for (int i=0;i<5;++i) bst_periodic();
@@ -421,3 +454,505 @@ TEST_F(StateMachineTests, SendCredentialsWrong) {
     ASSERT_EQ(NET_OUT_WIFI_LIST, network_output_flag);
     ASSERT_STREQ("WiFi Credentials wrong", network_out_data);
 }
+
+TEST_F(StateMachineTests, RejectBeforeDecryption) {
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    network_output_flag = NET_OUT_UNDEFINED;
+    const bst_input_stats* stats = bst_get_input_stats();
+
+    {   // Wrong header
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        pkt.hdr[0] = 'X';
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+        bst_periodic();
+        ASSERT_EQ(1u, stats->rejected_header);
+    }
+
+    {   // Correct packet but too long
+        bst_udp_hello_receive_pkt_t pkt[2];
+        prv_generate_test_hello(&pkt[0]);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t)+1);
+        bst_periodic();
+        ASSERT_EQ(1u, stats->rejected_length);
+    }
+
+    {   // No app session: The packet is not decrypted
+        bst_udp_bind_receive_pkt_t pkt;
+        prv_generate_test_bind(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_bind_receive_pkt_t));
+        const prv_ingress_slot& slot = prv_instance.ingress.slots[prv_instance.ingress.tail & (BST_INGRESS_RING_SLOTS-1)];
+        bst_periodic();
+        ASSERT_EQ(1u, stats->rejected_session);
+        ASSERT_EQ(0, memcmp(&pkt, &slot.pkt, sizeof(pkt)));
+    }
+
+    {   // Valid packets return their token, they do not use up the bucket
+        bst_udp_hello_receive_pkt_t pkt;
+        for (unsigned i=0; i < BST_INPUT_RATE_BURST+2; ++i) {
+            prv_generate_test_hello(&pkt);
+            bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+            bst_periodic();
+        }
+        ASSERT_EQ((uint32_t)BST_INPUT_RATE_BURST+2, stats->accepted);
+        ASSERT_EQ(0u, stats->rejected_rate);
+    }
+
+    {   // Corrupted hello packets: Only BST_INPUT_RATE_BURST are checked
+        bst_udp_hello_receive_pkt_t pkt;
+        for (unsigned i=0; i < BST_INPUT_RATE_BURST+4; ++i) {
+            prv_generate_test_hello(&pkt);
+            pkt.crc.crc[0] ^= 0xff;
+            bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+            bst_periodic();
+        }
+        ASSERT_EQ((uint32_t)BST_INPUT_RATE_BURST, stats->rejected_crc);
+        ASSERT_EQ(4u, stats->rejected_rate);
+
+        // A valid packet is rate limited as well, until the bucket is refilled
+        network_output_flag = NET_OUT_UNDEFINED;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+        bst_periodic();
+        ASSERT_EQ(5u, stats->rejected_rate);
+        ASSERT_EQ(NET_OUT_UNDEFINED, network_output_flag);
+
+        addTimeMsOverwrite(BST_INPUT_RATE_REFILL_MS);
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+        bst_periodic();
+        ASSERT_EQ((uint32_t)BST_INPUT_RATE_BURST+3, stats->accepted);
+        ASSERT_EQ(NET_OUT_WIFI_LIST, network_output_flag);
+    }
+
+    {   // Hello with a different app nonce during a session
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        pkt.app_nonce[0] = 'X';
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+        bst_periodic();
+        ASSERT_EQ(2u, stats->rejected_session);
+    }
+}
+
+TEST_F(StateMachineTests, FloodIsDroppedBeforeDecryption) {
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    const bst_input_stats* stats = bst_get_input_stats();
+
+    {   // Start an app session, bind packets are only decrypted within one
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+        bst_periodic();
+        ASSERT_EQ(1u, stats->accepted);
+    }
+
+    // Corrupted bind packets: The first BST_INPUT_RATE_BURST are decrypted in place,
+    // the rest of the flood is dropped untouched.
+    for (unsigned i=0; i < BST_INPUT_RATE_BURST+4; ++i) {
+        bst_udp_bind_receive_pkt_t pkt;
+        prv_generate_test_bind(&pkt);
+        pkt.crc.crc[0] ^= 0xff;
+        bst_network_input((char*)&pkt,sizeof(bst_udp_bind_receive_pkt_t));
+        const prv_ingress_slot& slot = prv_instance.ingress.slots[prv_instance.ingress.tail & (BST_INGRESS_RING_SLOTS-1)];
+        bst_periodic();
+        const bool decrypted = memcmp(&pkt, &slot.pkt, sizeof(pkt)) != 0;
+        ASSERT_EQ(i < BST_INPUT_RATE_BURST, decrypted);
+    }
+    ASSERT_EQ((uint32_t)BST_INPUT_RATE_BURST, stats->rejected_crc);
+    ASSERT_EQ(4u, stats->rejected_rate);
+    ASSERT_EQ(1u, stats->accepted);
+}
+
+TEST_F(StateMachineTests, IngressRing) {
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    const bst_input_stats* stats = bst_get_input_stats();
+
+    {   // Packets are only queued, they are processed in bst_periodic()
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+        ASSERT_EQ(0u, stats->accepted);
+    }
+    bst_periodic();
+    ASSERT_EQ(NET_OUT_WIFI_LIST, network_output_flag);
+
+    {   // Bind and bootstrap data back-to-back: Both are processed in one run
+        bst_udp_bind_receive_pkt_t pkt_bind;
+        prv_generate_test_bind(&pkt_bind);
+        bst_network_input((char*)&pkt_bind,sizeof(bst_udp_bind_receive_pkt_t));
+    }
+    // The data packet is encrypted with the new key
+    memcpy(prv_instance.crypto_secret, "new_secret", sizeof("new_secret"));
+    prv_instance.crypto_secret_len = sizeof("new_secret");
+    {
+        bst_udp_bootstrap_receive_pkt_t pkt;
+        prv_generate_test_data(&pkt, true);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_bootstrap_receive_pkt_t));
+    }
+
+    // The ring is full now
+    {
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+        ASSERT_EQ(1u, stats->rejected_ingress);
+    }
+
+    // Too short and too long packets are not queued
+    {
+        char data[sizeof(bst_udp_receive_any_pkt_t)+1] = {0};
+        bst_network_input(data, sizeof(bst_udp_receive_pkt_t)-1);
+        bst_network_input(data, sizeof(data));
+        ASSERT_EQ(3u, stats->rejected_ingress);
+    }
+
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bst_periodic();
+    ASSERT_EQ(3u, stats->accepted);
+    ASSERT_STREQ("wifi1",prv_instance.ssid);
+    ASSERT_EQ(NET_OUT_BOOTSTRAP_OK, network_output_flag);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_DEST, bst_get_state());
+}
+
+TEST_F(StateMachineTests, FactoryResetDropsQueuedPackets) {
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    const bst_input_stats* stats = bst_get_input_stats();
+
+    // The ring is not cleared by the reset, the network thread may still write it.
+    // Queued packets belong to the old session and are dropped.
+    bst_udp_hello_receive_pkt_t pkt;
+    prv_generate_test_hello(&pkt);
+    bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    const uint8_t head = prv_instance.ingress.head;
+    bst_factory_reset();
+    bst_periodic();
+    ASSERT_EQ(head, prv_instance.ingress.head);
+    ASSERT_EQ(head, prv_instance.ingress.tail);
+    ASSERT_EQ(0u, stats->accepted);
+
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    bst_periodic();
+    ASSERT_EQ(1u, stats->accepted);
+}
+
+TEST_F(StateMachineTests, NextWakeup) {
+    const time_t start = bst_get_system_time_ms();
+    prv_instance.options.bootstrap_key = "wrong";
+    prv_instance.state.timeout_connecting_bootstrap_app = 0;
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+    ASSERT_LT(BST_MAX_SLEEP_MS, prv_instance.options.timeout_connecting_state_ms);
+
+    // The connection state is polled
+    ASSERT_EQ(start+BST_MAX_SLEEP_MS, bst_next_wakeup_ms());
+    // Wake up for the next connection attempt
+    addTimeMsOverwrite(prv_instance.options.timeout_connecting_state_ms-100);
+    ASSERT_EQ(start+prv_instance.options.timeout_connecting_state_ms, bst_next_wakeup_ms());
+    addTimeMsOverwrite(200);
+    ASSERT_EQ(bst_get_system_time_ms(), bst_next_wakeup_ms());
+
+    prv_instance.options.bootstrap_key = "bootstrap_key";
+    bst_periodic();
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    ASSERT_EQ(bst_get_system_time_ms()+BST_MAX_SLEEP_MS, bst_next_wakeup_ms());
+
+    // A received packet is processed immediately
+    {
+        bst_udp_hello_receive_pkt_t pkt;
+        prv_generate_test_hello(&pkt);
+        bst_network_input((char*)&pkt,sizeof(bst_udp_hello_receive_pkt_t));
+    }
+    ASSERT_EQ(bst_get_system_time_ms(), bst_next_wakeup_ms());
+    bst_periodic();
+    ASSERT_EQ(NET_OUT_WIFI_LIST, network_output_flag);
+
+    // Pending work, like preparing the keystream for the next response, is done in idle calls
+    int idle_calls = 0;
+    while (bst_next_wakeup_ms() == bst_get_system_time_ms()) {
+        ASSERT_GT(100, ++idle_calls);
+        bst_periodic();
+    }
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+    ASSERT_LT(0, idle_calls);
+    ASSERT_EQ(sizeof(prv_instance.keystream.data), prv_instance.keystream.len);
+#endif
+    ASSERT_EQ(bst_get_system_time_ms()+BST_MAX_SLEEP_MS, bst_next_wakeup_ms());
+
+#ifdef BST_PRECOMPUTE_KEYSTREAM
+    // The keystream is wiped when the app session times out
+    const unsigned char zeros[sizeof(prv_instance.keystream.data)] = {0};
+    addTimeMsOverwrite(prv_instance.options.timeout_nonce_ms+1);
+    bst_periodic();
+    ASSERT_FALSE(prv_instance.keystream.started);
+    ASSERT_EQ(0u, prv_instance.keystream.len);
+    ASSERT_EQ(0, memcmp(zeros, prv_instance.keystream.data, sizeof(zeros)));
+    ASSERT_EQ(0, memcmp(zeros, prv_instance.keystream.state.s, sizeof(prv_instance.keystream.state.s)));
+    ASSERT_EQ(bst_get_system_time_ms()+BST_MAX_SLEEP_MS, bst_next_wakeup_ms());
+#endif
+}
+
+TEST_F(StateMachineTests, ConnectionEvents) {
+    bst_connect_options o = default_options();
+    o.connection_events = true;
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bst_setup(o, NULL, 0, NULL, 0);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+    // Only the next connection attempt
+    ASSERT_EQ(bst_get_system_time_ms()+o.timeout_connecting_state_ms, bst_next_wakeup_ms());
+
+    // The platform is connected, but did not report it yet
+    ASSERT_EQ(BST_STATE_CONNECTED, next_connect_state);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+
+    bst_connection_event(BST_STATE_CONNECTED);
+    ASSERT_EQ(bst_get_system_time_ms(), bst_next_wakeup_ms());
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    ASSERT_TRUE(this->connected_confirmed);
+
+    bst_connection_event(BST_STATE_NO_CONNECTION);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+
+    // A failure is not hidden by a following disconnect
+    bst_connection_event(BST_STATE_FAILED_CREDENTIALS_WRONG);
+    bst_connection_event(BST_STATE_NO_CONNECTION);
+    ASSERT_EQ(BST_STATE_FAILED_CREDENTIALS_WRONG, prv_instance.connection_event.state);
+    bst_periodic();
+    bst_connection_event(BST_STATE_NO_CONNECTION);
+    ASSERT_EQ(BST_STATE_NO_CONNECTION, prv_instance.connection_event.state);
+}
+
+TEST_F(StateMachineTests, ReconnectBackoff) {
+    bst_connect_options o = default_options();
+    o.bootstrap_key = "wrong";
+    o.reconnect_backoff = BST_BACKOFF_EXPONENTIAL;
+    o.reconnect_backoff_base_ms = 1000;
+    o.reconnect_backoff_cap_ms = 5000;
+    bst_setup(o, NULL, 0, NULL, 0);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+
+    // Base wait time, then doubled up to the cap
+    const time_t expected[] = {1000, 2000, 4000, 5000, 5000};
+    for (time_t wait : expected) {
+        const time_t delay = prv_instance.state.timeout_connecting_bootstrap_app - bst_get_system_time_ms();
+        ASSERT_EQ(wait, delay);
+        addTimeMsOverwrite(delay);
+        bst_periodic();
+        ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+    }
+
+    // A successful connection starts over
+    prv_instance.options.bootstrap_key = "bootstrap_key";
+    addTimeMsOverwrite(5000);
+    bst_periodic();
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    prv_instance.options.bootstrap_key = "wrong";
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+    addTimeMsOverwrite(prv_instance.state.timeout_connecting_bootstrap_app - bst_get_system_time_ms());
+    bst_periodic();
+    ASSERT_EQ(1000, prv_instance.state.timeout_connecting_bootstrap_app - bst_get_system_time_ms());
+}
+
+TEST_F(StateMachineTests, ReconnectJitter) {
+    bst_connect_options o = default_options();
+    o.bootstrap_key = "wrong";
+    o.reconnect_jitter_percent = 50;
+    bst_setup(o, NULL, 0, NULL, 0);
+
+    // The fixed interval is shortened by up to 50%
+    const time_t delay = prv_instance.state.timeout_connecting_bootstrap_app - bst_get_system_time_ms();
+    ASSERT_GE(o.timeout_connecting_state_ms, delay);
+    ASSERT_LE(o.timeout_connecting_state_ms/2, delay);
+    ASSERT_EQ(o.timeout_connecting_state_ms - (time_t)(bst_get_random() % (o.timeout_connecting_state_ms/2+1)), delay);
+}
+
+TEST_F(StateMachineTests, ConnectHint) {
+    const char data[] = "wifi1\0pwd\0test";
+    bst_connect_options o = default_options();
+    o.retry_connecting_to_destination_network = 3;
+    bst_setup(o, data, sizeof(data), NULL, 0);
+    ASSERT_FALSE(prv_instance.connect_hint.valid);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_DESTINATION_CONNECTED, bst_get_state());
+
+    // The hint is appended to the bootstrap data, but only written if it changed
+    bst_connect_hint hint = {{1,2,3,4,5,6}, 6, {192,168,1,20}, {255,255,255,0}, {192,168,1,1}, {192,168,1,1}};
+    bst_set_connect_hint(&hint);
+    ASSERT_EQ(sizeof(data)+sizeof(prv_connect_hint_record), stored_data_len);
+    ASSERT_EQ(0, memcmp(data, stored_data, sizeof(data)));
+    stored_data_len = 0;
+    bst_set_connect_hint(&hint);
+    ASSERT_EQ(0u, stored_data_len);
+
+    // Reboot: The first attempt uses the hint
+    hint.channel = 11;
+    bst_set_connect_hint(&hint);
+    hint.channel = 6;
+    bst_set_connect_hint(&hint);
+    bst_setup(o, stored_data, stored_data_len, NULL, 0);
+    ASSERT_STREQ("test", prv_instance.additional);
+    ASSERT_EQ(1, hinted_connects);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_DESTINATION_CONNECTED, bst_get_state());
+
+    // The access point changed: Fall back to a full scan instead of bootstrap mode
+    hint_works = false;
+    bst_setup(o, stored_data, stored_data_len, NULL, 0);
+    ASSERT_EQ(2, hinted_connects);
+    ASSERT_EQ(BST_STATE_FAILED_SSID_NOT_FOUND, next_connect_state);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_DEST, bst_get_state());
+    ASSERT_EQ(BST_STATE_CONNECTED, next_connect_state);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_DESTINATION_CONNECTED, bst_get_state());
+
+    // The failed hint is not used again until the platform reports a new one
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bst_periodic();
+    addTimeMsOverwrite(o.timeout_connecting_state_ms+1);
+    bst_periodic();
+    ASSERT_EQ(2, hinted_connects);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_DESTINATION_CONNECTED, bst_get_state());
+    bst_set_connect_hint(&hint);
+    ASSERT_FALSE(prv_instance.connect_hint.failed);
+
+    // Hints of the bootstrap network are ignored
+    bst_factory_reset();
+    bst_periodic();
+    stored_data_len = 0;
+    bst_set_connect_hint(&hint);
+    ASSERT_EQ(0u, stored_data_len);
+    ASSERT_FALSE(prv_instance.connect_hint.valid);
+}
+
+TEST_F(StateMachineTests, ConnectHintEvents) {
+    const char data[] = "wifi1\0pwd\0test";
+    bst_connect_options o = default_options();
+    bst_setup(o, data, sizeof(data), NULL, 0);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_DESTINATION_CONNECTED, bst_get_state());
+    bst_connect_hint hint = {{1,2,3,4,5,6}, 6, {192,168,1,20}, {255,255,255,0}, {192,168,1,1}, {192,168,1,1}};
+    bst_set_connect_hint(&hint);
+
+    // Reboot: The platform reports the hinted connection. With the static ip of the hint
+    // there is no dhcp step, the association alone is reported as connected.
+    o.connection_events = true;
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bst_setup(o, stored_data, stored_data_len, NULL, 0);
+    ASSERT_EQ(1, hinted_connects);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_DEST, bst_get_state());
+    bst_connection_event(BST_STATE_CONNECTING);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_DEST, bst_get_state());
+
+    bst_connection_event(BST_STATE_CONNECTED);
+    ASSERT_EQ(bst_get_system_time_ms(), bst_next_wakeup_ms());
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_DESTINATION_CONNECTED, bst_get_state());
+    ASSERT_EQ(1, hinted_connects);
+    ASSERT_FALSE(prv_instance.connect_hint.failed);
+
+    // The platform reports the unchanged hint again, nothing is written
+    stored_data_len = 0;
+    bst_set_connect_hint(&hint);
+    ASSERT_EQ(0u, stored_data_len);
+    ASSERT_TRUE(prv_instance.connect_hint.valid);
+}
+
+TEST_F(StateMachineTests, BootstrapDiscovery) {
+    bst_connect_options o = default_options();
+    o.bootstrap_discovery_interval_ms = 1000;
+    bootstrap_visible = false;
+    m_state = BST_MODE_UNINITIALIZED;
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bst_setup(o, NULL, 0, NULL, 0);
+
+    // Only probe while the bootstrap network is not in range
+    ASSERT_EQ(1, probes);
+    bst_periodic();
+    ASSERT_EQ(bst_get_system_time_ms()+1000, prv_instance.state.timeout_connecting_bootstrap_app);
+    addTimeMsOverwrite(1000);
+    bst_periodic();
+    ASSERT_EQ(2, probes);
+    ASSERT_EQ(0, probe_channel_hint);
+    ASSERT_EQ(BST_MODE_UNINITIALIZED, m_state);
+
+    // Connect as soon as it is seen
+    bootstrap_visible = true;
+    addTimeMsOverwrite(1000);
+    bst_periodic();
+    ASSERT_EQ(3, probes);
+    ASSERT_EQ(bst_get_system_time_ms(), bst_next_wakeup_ms());
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, m_state);
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+
+    // The channel of the last sighting is the hint for the next discovery
+    next_connect_state = BST_STATE_NO_CONNECTION;
+    bootstrap_visible = false;
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, bst_get_state());
+    addTimeMsOverwrite(o.timeout_connecting_state_ms);
+    bst_periodic();
+    ASSERT_EQ(4, probes);
+    ASSERT_EQ(6, probe_channel_hint);
+
+    // Not found on that channel: The next discovery looks on all channels
+    addTimeMsOverwrite(1000);
+    bst_periodic();
+    ASSERT_EQ(5, probes);
+    ASSERT_EQ(0, probe_channel_hint);
+}
+
+#ifdef BST_TRACE
+TEST_F(StateMachineTests, Trace) {
+    bst_periodic();
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, bst_get_state());
+
+    // Setup connected to the bootstrap network, periodic noticed the connection
+    bst_trace_record records[BST_TRACE_SLOTS];
+    ASSERT_EQ(3u, bst_trace_snapshot(records, BST_TRACE_SLOTS));
+    ASSERT_EQ(3u, bst_trace_drain(records, BST_TRACE_SLOTS));
+    ASSERT_EQ(BST_TRACE_STATE, records[0].event);
+    ASSERT_EQ(BST_MODE_CONNECTING_TO_BOOTSTRAP, records[0].arg);
+    ASSERT_EQ(BST_TRACE_CONNECT, records[1].event);
+    ASSERT_EQ(0, records[1].arg);
+    ASSERT_EQ(BST_TRACE_STATE, records[2].event);
+    ASSERT_EQ(BST_MODE_WAITING_FOR_DATA, records[2].arg);
+    ASSERT_EQ((uint32_t)bst_get_system_time_ms(), records[2].time_ms);
+    ASSERT_EQ(0u, bst_trace_drain(records, BST_TRACE_SLOTS));
+
+    // A rejected packet records the index of its counter in bst_input_stats
+    bst_udp_hello_receive_pkt_t pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    for (int i=0; i < BST_TRACE_SLOTS+2; ++i) {
+        addTimeMsOverwrite(1);
+        bst_network_input((char*)&pkt, sizeof(pkt));
+        bst_periodic();
+    }
+    ASSERT_EQ((uint32_t)BST_TRACE_SLOTS+2, bst_get_input_stats()->rejected_header);
+
+    // Only the newest records are kept
+    ASSERT_EQ((size_t)BST_TRACE_SLOTS, bst_trace_drain(records, BST_TRACE_SLOTS));
+    ASSERT_EQ(BST_TRACE_PACKET_REJECTED, records[BST_TRACE_SLOTS-1].event);
+    ASSERT_EQ(offsetof(bst_input_stats, rejected_header)/sizeof(uint32_t), records[BST_TRACE_SLOTS-1].arg);
+    ASSERT_EQ((uint32_t)bst_get_system_time_ms(), records[BST_TRACE_SLOTS-1].time_ms);
+    ASSERT_EQ(records[BST_TRACE_SLOTS-1].time_ms - (BST_TRACE_SLOTS-1), records[0].time_ms);
+}
+#endif
@@ -21,15 +21,16 @@
 
 bst_platform* bst_platform::instance = nullptr;
 
-bool bst_platform::check_send_header_and_decrypt(bst_udp_send_pkt_t* pkt)
+bool bst_platform::check_send_header_and_decrypt(bst_udp_send_pkt_t* pkt, size_t pkt_len)
 {
+    // Any protocol version
     const char hdr[] = BST_NETWORK_HEADER;
-    if (memcmp(pkt->hdr, hdr, BST_NETWORK_HEADER_SIZE) != 0)
+    if (memcmp(pkt->hdr, hdr, BST_NETWORK_HEADER_SIZE-1) != 0)
         return false;
 
     // decrypt
     const size_t offset = sizeof(bst_udp_receive_pkt_t);
-    const size_t pkt_len= sizeof(bst_udp_send_pkt_t)-offset;
+    pkt_len -= offset;
     unsigned char* out_in = (unsigned char*)pkt+offset;
 
     spritz_decrypt(out_in,out_in,pkt_len,
@@ -53,9 +54,19 @@ bst_connect_options bst_platform::default_options() {
     o.retry_connecting_to_destination_network = 0;
     o.retry_connecting_to_bootstrap_network = 0;
     o.timeout_connecting_state_ms = 10000;
+    o.timeout_nonce_ms = 60000;
     o.bootstrap_ssid = "bootstrap_ssid";
     o.bootstrap_key = "bootstrap_key";
     o.external_confirmation_mode = BST_CONFIRM_NOT_REQUIRED;
+    o.wifi_list_size_buckets = false;
+    o.wifi_scan_cache_ttl_ms = 0;
+    o.connection_events = false;
+    o.reconnect_backoff = BST_BACKOFF_FIXED;
+    o.reconnect_backoff_multiplier = 0;
+    o.reconnect_backoff_base_ms = 0;
+    o.reconnect_backoff_cap_ms = 0;
+    o.reconnect_jitter_percent = 0;
+    o.bootstrap_discovery_interval_ms = 0;
     return o;
 }
 
@@ -103,6 +114,18 @@ void bst_connect_to_wifi(const char* ssid, const char* pwd)
         bst_platform::instance->bst_connect_to_wifi(ssid, pwd);
 }
 
+void bst_connect_to_wifi_hinted(const char* ssid, const char* pwd, const bst_connect_hint* hint)
+{
+    if (bst_platform::instance)
+        bst_platform::instance->bst_connect_to_wifi_hinted(ssid, pwd, hint);
+}
+
+void bst_discover_bootstrap_network(const char* ssid, uint8_t channel_hint)
+{
+    if (bst_platform::instance)
+        bst_platform::instance->bst_discover_bootstrap_network(ssid, channel_hint);
+}
+
 void bst_connect_advanced(const char* data)
 {
     if (bst_platform::instance)
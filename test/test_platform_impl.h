@@ -34,7 +34,7 @@ public:
      * @param pkt The send packet.
      * @return
      */
-    static bool check_send_header_and_decrypt(bst_udp_send_pkt_t* pkt);
+    static bool check_send_header_and_decrypt(bst_udp_send_pkt_t* pkt, size_t pkt_len = sizeof(bst_udp_send_pkt_t));
 
     /**
      * @brief Return a bst_connect_options object with some
@@ -64,6 +64,18 @@ public:
     // FAILED_CREDENTIALS_WRONG or FAILED_SSID_NOT_FOUND state.
     virtual void bst_connect_to_wifi(const char* ssid, const char* pwd) = 0;
 
+    // Connect with the hint of bst_set_connect_hint(). Optional, like the weak default of the library.
+    virtual void bst_connect_to_wifi_hinted(const char* ssid, const char* pwd, const bst_connect_hint* hint) {
+        (void)hint;
+        bst_connect_to_wifi(ssid, pwd);
+    }
+
+    // Look for the bootstrap network. Optional, like the weak default of the library.
+    virtual void bst_discover_bootstrap_network(const char* ssid, uint8_t channel_hint) {
+        (void)ssid;
+        ::bst_bootstrap_network_found(channel_hint);
+    }
+
     // If you need to bootstrap not only the wifi connection but for example also
     // need to connect to a server, you may set the **need_advanced_connection** option.
     // After a successful wifi connection this method will be called with the additional data the app provided.
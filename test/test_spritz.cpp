@@ -60,3 +60,131 @@ TEST(TestCrypto, TestInput) {
     v = bst_crc16(message+offset, len);
     ASSERT_TRUE(cmp == v);
 }
+
+TEST(TestCrypto, KeyedContext) {
+    const unsigned char msg[] = { 'a', 'r', 'c', 'f', 'o', 'u', 'r' };
+    unsigned const char nonce[] = "nonce";
+    unsigned const char key[] = "secret";
+    unsigned char expected[sizeof msg];
+    unsigned char out[sizeof msg];
+    unsigned i;
+
+    spritz_encrypt(expected,msg,sizeof msg,nonce,sizeof nonce,key, sizeof key);
+
+    spritz_keyed_ctx ctx;
+    spritz_keyed_setup(&ctx, key, sizeof key);
+
+    // The keyed context is not modified and can be used for many messages.
+    for (int round = 0; round < 2; ++round) {
+        spritz_keyed_encrypt(out,msg,sizeof msg,nonce,sizeof nonce,&ctx);
+        for (i = 0; i < sizeof msg; i++) {
+            ASSERT_EQ(expected[i], out[i]);
+        }
+
+        spritz_keyed_decrypt(out,out,sizeof msg,nonce,sizeof nonce,&ctx);
+        for (i = 0; i < sizeof msg; i++) {
+            ASSERT_EQ(msg[i], out[i]);
+        }
+    }
+
+    spritz_keyed_wipe(&ctx);
+}
+
+TEST(TestCrypto, StreamingInterface) {
+    unsigned char msg[100];
+    unsigned const char nonce[] = "nonce";
+    unsigned const char key[] = "secret";
+    unsigned char expected[sizeof msg];
+    unsigned char out[sizeof msg];
+    unsigned i;
+
+    for (i = 0; i < sizeof msg; i++)
+        msg[i] = (unsigned char)(i * 7);
+
+    spritz_encrypt(expected,msg,sizeof msg,nonce,sizeof nonce,key, sizeof key);
+
+    // Encrypt in uneven fragments
+    spritz_state state;
+    spritz_init(&state);
+    spritz_absorb(&state, key, 2);
+    spritz_absorb(&state, key+2, sizeof key-2);
+    spritz_absorb_stop(&state);
+    spritz_absorb(&state, nonce, sizeof nonce);
+    spritz_encrypt_update(&state, out, msg, 1);
+    spritz_encrypt_update(&state, out+1, msg+1, 60);
+    spritz_encrypt_update(&state, out+61, msg+61, sizeof msg-61);
+    spritz_wipe(&state);
+
+    for (i = 0; i < sizeof msg; i++) {
+        ASSERT_EQ(expected[i], out[i]);
+    }
+
+    // Decrypt in place in fragments with a keyed context
+    spritz_keyed_ctx ctx;
+    spritz_keyed_setup(&ctx, key, sizeof key);
+    spritz_keyed_start(&state, nonce, sizeof nonce, &ctx);
+    spritz_decrypt_update(&state, out, out, 33);
+    spritz_decrypt_update(&state, out+33, out+33, sizeof msg-33);
+
+    for (i = 0; i < sizeof msg; i++) {
+        ASSERT_EQ(msg[i], out[i]);
+    }
+
+    // Squeezing in chunks equals the one-shot keystream
+    spritz_stream(expected, sizeof expected, key, sizeof key);
+    spritz_init(&state);
+    spritz_absorb(&state, key, sizeof key);
+    spritz_squeeze(&state, out, 10);
+    spritz_squeeze(&state, out+10, sizeof out-10);
+
+    for (i = 0; i < sizeof out; i++) {
+        ASSERT_EQ(expected[i], out[i]);
+    }
+}
+
+TEST(TestCrypto, MultiLane) {
+    const unsigned lane_count = SPRITZ_MULTI_LANES * 2 + 3;
+    unsigned char msg[lane_count][64];
+    unsigned char expected[lane_count][64];
+    unsigned char out[lane_count][64];
+    unsigned char nonces[lane_count][BST_NONCE_SIZE];
+    spritz_keyed_ctx keys[2];
+    spritz_lane lanes[lane_count];
+    unsigned l, i;
+
+    spritz_keyed_setup(&keys[0], (const unsigned char*)"secret", 6);
+    spritz_keyed_setup(&keys[1], (const unsigned char*)"other_secret", 12);
+
+    for (l = 0; l < lane_count; l++) {
+        for (i = 0; i < sizeof msg[l]; i++)
+            msg[l][i] = (unsigned char)(l * 31 + i);
+        for (i = 0; i < BST_NONCE_SIZE; i++)
+            nonces[l][i] = (unsigned char)(l + i);
+
+        lanes[l].out = out[l];
+        lanes[l].in = msg[l];
+        lanes[l].len = (l * 13) % sizeof msg[l]; // different lengths, including 0
+        lanes[l].nonce = nonces[l];
+        lanes[l].noncelen = BST_NONCE_SIZE;
+        lanes[l].ctx = &keys[l % 2];
+
+        spritz_keyed_encrypt(expected[l], msg[l], lanes[l].len, nonces[l], BST_NONCE_SIZE, lanes[l].ctx);
+    }
+
+    spritz_encrypt_multi(lanes, lane_count);
+
+    for (l = 0; l < lane_count; l++) {
+        for (i = 0; i < lanes[l].len; i++) {
+            ASSERT_EQ(expected[l][i], out[l][i]);
+        }
+        lanes[l].in = out[l];
+    }
+
+    spritz_decrypt_multi(lanes, lane_count);
+
+    for (l = 0; l < lane_count; l++) {
+        for (i = 0; i < lanes[l].len; i++) {
+            ASSERT_EQ(msg[l][i], out[l][i]);
+        }
+    }
+}